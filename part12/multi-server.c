@@ -2,6 +2,8 @@
  * multi-server.c
  */
 
+#define _GNU_SOURCE     /* for splice() */
+
 #include <stdio.h>      /* for printf() and fprintf() */
 #include <sys/socket.h> /* for socket(), bind(), and connect() */
 #include <arpa/inet.h>  /* for sockaddr_in and inet_ntoa() */
@@ -12,280 +14,2694 @@
 #include <netdb.h>      /* for gethostbyname() */
 #include <signal.h>     /* for signal() */
 #include <sys/stat.h>   /* for stat() */
+#include <sys/sendfile.h> /* for sendfile() */
+#include <netinet/tcp.h>  /* for TCP_CORK */
 #include <sys/wait.h>
 #include <sys/mman.h>   /* for mmap */
-#include <semaphore.h>  /* for POSIX semaphore */
 #include <fcntl.h>
 #include <errno.h>
+#include <stdarg.h>     /* for va_list */
+#include <pthread.h>    /* for the logger thread */
+#include <sys/uio.h>    /* for writev() */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  /* for the SSE2, SSE4.2 and AVX2 intrinsics */
+#define HAVE_X86_SIMD 1
+#endif
+#include <dirent.h>     /* for opendir() */
 
 #define MAXPENDING 5    /* Maximum outstanding connection requests */
 
-#define DISK_IO_BUF_SIZE 4096
+#define DISK_IO_BUF_SIZE 4096
+
+#define SPLICE_PIPE_SIZE 65536 /* bytes moved per splice() through the pipe */
+
+#define REQ_BUF_SIZE 8192   /* longest request line plus headers we take */
+#define REQ_MAX_HEADERS 32  /* most header lines in one request */
+
+#define LOG_RING_SIZE 65536 /* access log bytes a worker can buffer, power of 2 */
+#define LOG_MAX_RINGS 64    /* threads per process that can log */
+#define LOG_LINE_MAX 512    /* longest access log line */
+#define LOG_FLUSH_MS 20     /* how often the logger writes the rings out */
+
+#define HIST_SUB_BITS 4 /* latency buckets per power of two: 2^4 */
+#define STATS_PAGE_SIZE 4096 /* room for the /statistics page */
+
+#define CACHE_BUDGET (32 * 1024 * 1024) /* default bytes of shared file cache */
+#define CACHE_ENTRIES 1024      /* files the shared cache can hold, a power of 2 */
+#define CACHE_PROBES 8          /* slots from its home slot a file may use */
+#define CACHE_PATH_MAX 256      /* longest cacheable file path */
+#define CACHE_MAX_FILE_FRACTION 8 /* cache files up to budget/8 bytes */
+#define CACHE_REVALIDATE_SECS 1 /* how often a cached file is stat()ed */
+
+#define DIRCACHE_ENTRIES 16     /* directory listings kept by each child */
+#define DIRCACHE_MAX_LISTING (256 * 1024) /* longest listing kept */
+
+/*
+ * The pool of children grows and shrinks with the load, the way Apache's
+ * prefork MPM does it: the parent keeps between MIN_SPARE and MAX_SPARE
+ * children idle in accept(), but never runs more than MAX_CHILDREN.
+ */
+#define START_CHILDREN 4        /* children forked at startup */
+#define MIN_SPARE 2             /* default fewest idle children (-m) */
+#define MAX_SPARE 8             /* default most idle children (-M) */
+#define MAX_CHILDREN 32         /* default most children (-n) */
+#define CHILD_SLOTS 64          /* scoreboard size, the largest -n */
+#define MAX_SPAWN_RATE 32       /* most children forked in one tick */
+#define MAINTENANCE_MSEC 1000   /* how often the parent checks the pool */
+
+#define RATE_LIMIT 0            /* default connections a second per client (-R) */
+#define RATE_BURST 20           /* default connections a client may burst (-B) */
+#define RATE_SLOTS 4096         /* clients the rate limiter tracks, power of 2 */
+#define RATE_PROBES 8           /* slots an address may take in that table */
+
+static void die(const char *message)
+{
+    perror(message);
+    exit(1); 
+}
+
+/*
+ * Access log.
+ *
+ * All a worker does for a log line is format it into its own ring
+ * buffer.  A logger thread drains all the rings every LOG_FLUSH_MS with a
+ * single writev().  Every ring has one producer and one consumer, so
+ * head and tail only need atomic loads and stores.  When a ring is full
+ * the line is dropped and counted rather than making the worker wait.
+ *
+ * With -l the log goes to a file instead of stderr.  SIGHUP makes the
+ * loggers reopen the file, so it can be rotated by renaming it and then
+ * sending SIGHUP.
+ */
+struct logring {
+    unsigned long head;         // bytes written by the worker
+    char pad1[56];
+    unsigned long tail;         // bytes written out by the logger
+    char pad2[56];
+    char data[LOG_RING_SIZE];
+};
+
+// Shared by all processes, so that a SIGHUP to any of them is seen by all.
+struct logshared {
+    unsigned int generation;    // bumped by SIGHUP
+    unsigned long dropped;      // lines lost to full rings
+};
+
+static struct logring *logRings[LOG_MAX_RINGS];
+static int nLogRings;
+static __thread struct logring *myLogRing;
+static struct logshared *logShared;
+static const char *logPath;     // NULL means stderr
+static int logFd = STDERR_FILENO;
+
+static void sig_hup(int signo)
+{
+    __atomic_add_fetch(&logShared->generation, 1, __ATOMIC_RELAXED);
+}
+
+static int logOpen(void)
+{
+    int fd = open(logPath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        perror(logPath);
+    return fd;
+}
+
+/*
+ * Set up logging to path, or to stderr if path is NULL.  Called once
+ * before any worker (or child) starts.
+ */
+static void logInit(const char *path)
+{
+    logShared = mmap(0, sizeof(*logShared), PROT_READ | PROT_WRITE, 
+            MAP_ANON | MAP_SHARED, -1, 0);
+    if (logShared == MAP_FAILED)
+        die("mmap error");
+
+    logPath = path;
+    if (logPath != NULL && (logFd = logOpen()) < 0)
+        exit(1);
+
+    struct sigaction act;
+    act.sa_handler = sig_hup;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    if (sigaction(SIGHUP, &act, NULL) < 0)
+        die("sigaction failed");
+}
+
+// Give the calling thread a ring.  Returns NULL if there are none left.
+static struct logring *logRegister(void)
+{
+    int i = __atomic_load_n(&nLogRings, __ATOMIC_RELAXED);
+    do {
+        if (i >= LOG_MAX_RINGS)
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&nLogRings, &i, i + 1, 0, 
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    struct logring *r = (struct logring *)malloc(sizeof(*r));
+    if (r == NULL)
+        die("malloc failed");
+    r->head = 0;
+    r->tail = 0;
+    __atomic_store_n(&logRings[i], r, __ATOMIC_RELEASE);
+    return myLogRing = r;
+}
+
+/*
+ * Queue one log line.  format should end with a newline.
+ */
+static void logPrintf(const char *format, ...)
+{
+    char line[LOG_LINE_MAX];
+    va_list ap;
+
+    va_start(ap, format);
+    int n = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if (n <= 0)
+        return;
+    if (n >= (int)sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+
+    struct logring *r = myLogRing ? myLogRing : logRegister();
+    if (r == NULL) {
+        __atomic_add_fetch(&logShared->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    unsigned long head = r->head;
+    unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING_SIZE - (head - tail) < (unsigned long)n) {
+        __atomic_add_fetch(&logShared->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t off = head & (LOG_RING_SIZE - 1);
+    size_t first = n < LOG_RING_SIZE - off ? n : LOG_RING_SIZE - off;
+    memcpy(r->data + off, line, first);
+    memcpy(r->data, line + first, n - first);
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+}
+
+/*
+ * writev() all of iov, however many calls it takes.  On an error the
+ * rest is lost; there is nowhere left to report it.
+ */
+static void logWriteAll(struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(logFd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void *logger(void *arg)
+{
+    struct iovec iov[2 * LOG_MAX_RINGS];
+    struct logring *rings[LOG_MAX_RINGS];
+    unsigned long heads[LOG_MAX_RINGS];
+    unsigned int generation = 
+        __atomic_load_n(&logShared->generation, __ATOMIC_RELAXED);
+    struct timespec interval = { 0, LOG_FLUSH_MS * 1000000L };
+    int i;
+
+    pthread_detach(pthread_self());
+    for (;;) {
+        nanosleep(&interval, NULL);
+
+        // reopen the log file if it was rotated
+        unsigned int g = 
+            __atomic_load_n(&logShared->generation, __ATOMIC_RELAXED);
+        if (g != generation && logPath != NULL) {
+            int fd = logOpen();
+            if (fd >= 0) {
+                dup2(fd, logFd);
+                close(fd);
+            }
+        }
+        generation = g;
+
+        // collect what every ring has, at most two pieces per ring
+        int nRings = __atomic_load_n(&nLogRings, __ATOMIC_RELAXED);
+        if (nRings > LOG_MAX_RINGS)
+            nRings = LOG_MAX_RINGS;
+        int cnt = 0;
+        for (i = 0; i < nRings; i++) {
+            struct logring *r = rings[i] = 
+                __atomic_load_n(&logRings[i], __ATOMIC_ACQUIRE);
+            if (r == NULL)
+                continue;
+            unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            size_t len = head - r->tail;
+            size_t off = r->tail & (LOG_RING_SIZE - 1);
+            size_t first = len < LOG_RING_SIZE - off ? len : 
+                LOG_RING_SIZE - off;
+            heads[i] = head;
+            if (len == 0)
+                continue;
+            iov[cnt].iov_base = r->data + off;
+            iov[cnt++].iov_len = first;
+            if (len > first) {
+                iov[cnt].iov_base = r->data;
+                iov[cnt++].iov_len = len - first;
+            }
+        }
+        if (cnt == 0)
+            continue;
+        logWriteAll(iov, cnt);
+
+        // hand the space back to the workers
+        for (i = 0; i < nRings; i++)
+            if (rings[i] != NULL)
+                __atomic_store_n(&rings[i]->tail, heads[i], __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Start the logger thread of this process.
+static void logStart(void)
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, logger, NULL) != 0)
+        die("pthread_create failed");
+}
+
+// Wait until the logger thread has written out our ring, before we exit.
+static void logDrain(void)
+{
+    struct timespec interval = { 0, LOG_FLUSH_MS * 1000000L };
+
+    while (myLogRing != NULL && 
+            __atomic_load_n(&myLogRing->tail, __ATOMIC_ACQUIRE) != 
+            myLogRing->head)
+        nanosleep(&interval, NULL);
+}
+
+/*
+ * Clock service.
+ *
+ * A clock thread wakes up at every full second of the wall clock and
+ * publishes the time in a shared page: wall clock and monotonic seconds,
+ * and the Date header line for that second, already formatted.  The page
+ * is MAP_SHARED and the thread runs in the process that forks the
+ * children, so one thread keeps the time for every worker and child.
+ * Readers take no lock: the clock thread makes seq odd while it writes
+ * and even again when it is done, and a reader retries when seq was odd
+ * or changed under it.
+ */
+#define DATE_LINE_LEN 37    /* "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" */
+#define DATE_LINE_MAX 40    /* room for a Date line and its NUL */
+
+struct clockpage {
+    unsigned int seq;
+    time_t wall;                // CLOCK_REALTIME seconds
+    time_t mono;                // CLOCK_MONOTONIC seconds
+    char dateLine[DATE_LINE_MAX];
+};
+
+static struct clockpage *clockPage;
+
+static char *format2(char *p, unsigned int v)
+{
+    p[0] = '0' + v / 10 % 10;
+    p[1] = '0' + v % 10;
+    return p + 2;
+}
+
+/*
+ * Format the Date header line for t, an RFC 7231 IMF-fixdate, into buf,
+ * which must hold DATE_LINE_MAX bytes.  We do the calendar arithmetic
+ * ourselves (Howard Hinnant's days-to-civil): gmtime_r() takes a glibc
+ * lock, and a child forked while the clock thread held it would never
+ * see it released.
+ */
+static void formatDateLine(char *buf, time_t t)
+{
+    static const char weekdays[] = "ThuFriSatSunMonTueWed"; // from 1970-01-01
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    unsigned long days = (unsigned long)t / 86400;
+    unsigned long secs = (unsigned long)t % 86400;
+    char *p = buf;
+
+    unsigned long z = days + 719468;
+    unsigned long era = z / 146097;
+    unsigned long doe = z - era * 146097;
+    unsigned long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned long mp = (5 * doy + 2) / 153;
+    unsigned int mday = doy - (153 * mp + 2) / 5 + 1;
+    unsigned int month = mp < 10 ? mp + 3 : mp - 9;
+    unsigned int year = yoe + era * 400 + (month <= 2);
+
+    memcpy(p, "Date: ", 6);
+    p += 6;
+    memcpy(p, weekdays + 3 * (days % 7), 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p = format2(p, mday);
+    *p++ = ' ';
+    memcpy(p, months + 3 * (month - 1), 3);
+    p += 3;
+    *p++ = ' ';
+    p = format2(p, year / 100);
+    p = format2(p, year);
+    *p++ = ' ';
+    p = format2(p, secs / 3600);
+    *p++ = ':';
+    p = format2(p, secs / 60 % 60);
+    *p++ = ':';
+    p = format2(p, secs % 60);
+    memcpy(p, " GMT\r\n", 7);
+}
+
+// Publish the current time.  Called by the clock thread only.
+static void clockUpdate(void)
+{
+    struct timespec wall, mono;
+    char line[DATE_LINE_MAX];
+    unsigned int seq = clockPage->seq;
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    formatDateLine(line, wall.tv_sec);
+
+    __atomic_store_n(&clockPage->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&clockPage->wall, wall.tv_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&clockPage->mono, mono.tv_sec, __ATOMIC_RELAXED);
+    memcpy(clockPage->dateLine, line, sizeof(line));
+    __atomic_store_n(&clockPage->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void *clockThread(void *arg)
+{
+    struct timespec next;
+
+    for (;;) {
+        // sleep until the next full second
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec++;
+        next.tv_nsec = 0;
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL)
+                == EINTR)
+            ;
+        clockUpdate();
+    }
+    return NULL;
+}
+
+/*
+ * Set up the clock page and start the clock thread.  Called once from
+ * main() before any worker or child starts.  The thread blocks all
+ * signals, so that they still interrupt the main thread's system calls.
+ */
+static void clockStart(void)
+{
+    sigset_t all, old;
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    clockPage = mmap(0, sizeof(*clockPage), PROT_READ | PROT_WRITE,
+            MAP_ANON | MAP_SHARED, -1, 0);
+    if (clockPage == MAP_FAILED)
+        die("mmap error");
+    clockUpdate();
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, clockThread, NULL) != 0)
+        die("pthread_create failed");
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Monotonic seconds, for timeouts.  At most a second behind.
+static inline time_t clockSeconds(void)
+{
+    return __atomic_load_n(&clockPage->mono, __ATOMIC_RELAXED);
+}
+
+// Wall clock seconds.  At most a second behind.
+static inline time_t clockWallSeconds(void)
+{
+    return __atomic_load_n(&clockPage->wall, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy the Date header line of the current second into buf, which must
+ * hold DATE_LINE_MAX bytes.  The line is NUL-terminated; returns its
+ * length, DATE_LINE_LEN.
+ */
+static size_t clockDateLine(char *buf)
+{
+    unsigned int seq;
+
+    do {
+        seq = __atomic_load_n(&clockPage->seq, __ATOMIC_ACQUIRE);
+        memcpy(buf, clockPage->dateLine, DATE_LINE_MAX);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) ||
+            seq != __atomic_load_n(&clockPage->seq, __ATOMIC_RELAXED));
+    return DATE_LINE_LEN;
+}
+
+static volatile sig_atomic_t key;
+
+/*
+ * Latency histograms.
+ *
+ * Log-linear buckets in the style of HdrHistogram: every latency below
+ * HIST_SUB_BUCKETS microseconds has a bucket of its own, and every power
+ * of two above that is split into HIST_SUB_BUCKETS equal buckets, so a
+ * recorded value is off by less than 1/HIST_SUB_BUCKETS.  A histogram is
+ * a plain array of counters, so the histograms of all children merge by
+ * adding them up bucket by bucket.
+ */
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS) // < 2^32 us
+
+enum latency_phase {
+    PHASE_PARSE,    // request line received until the end of the headers
+    PHASE_OPEN,     // finding the file: caches, stat() and open()
+    PHASE_SEND,     // sending the body
+    N_PHASES
+};
+
+static const char *phaseNames[N_PHASES] = {
+    "request parse", "stat/open", "body send"
+};
+
+// phaseNames as JSON keys and Prometheus label values
+static const char *phaseKeys[N_PHASES] = {
+    "request_parse", "stat_open", "body_send"
+};
+
+struct histogram {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long sum; // of all recorded values
+};
+
+static unsigned long nowUsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int histBucket(unsigned long usec)
+{
+    if (usec > 0xffffffffUL)
+        usec = 0xffffffffUL;
+    if (usec < HIST_SUB_BUCKETS)
+        return usec;
+    int shift = 63 - __builtin_clzl(usec) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + 
+        (usec >> shift) - HIST_SUB_BUCKETS;
+}
+
+// The highest latency that falls into bucket.
+static unsigned long histBucketValue(int bucket)
+{
+    if (bucket < HIST_SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / HIST_SUB_BUCKETS - 1;
+    return ((unsigned long)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS + 1)
+            << shift) - 1;
+}
+
+/*
+ * Per-client rate limiting.
+ *
+ * Every client address has a token bucket that fills up at rate tokens a
+ * second to at most burst tokens, and each new connection takes a token.
+ * A client whose bucket is empty gets a 429 right away, before it costs
+ * more than an accept(), so one aggressive client cannot keep all the
+ * children busy.
+ *
+ * The buckets are a fixed-size open addressing table that lives in the
+ * shared statistics area, so every process sees the same buckets, and
+ * none of them takes a lock.  A bucket's level and the time it was last
+ * filled are one word, updated with compare-and-swap.  A process claims
+ * a slot for an address by swapping RATE_CLAIMING into its key, fills
+ * the bucket, and then publishes the key.  An address may only use
+ * RATE_PROBES slots after its home slot.  A bucket that has filled up
+ * again is no different from a new one, so its slot can be taken over
+ * by another address.  If all of them belong to clients that are busy
+ * right now, the connection is let through and counted as untracked.
+ */
+#define RATE_CLAIMING 1         /* key of a slot that is being claimed */
+#define RATE_LEVEL_BITS 24      /* of a bucket word, the rest is time */
+#define RATE_LEVEL_MASK ((1UL << RATE_LEVEL_BITS) - 1)
+
+struct ratebucket {
+    unsigned long key;      // hash of the client address, 0 if never used
+    unsigned long state;    // ms since epoch << RATE_LEVEL_BITS | level
+};
+
+struct ratelimit {
+    unsigned int rate;        // tokens a second, 0 turns limiting off
+    unsigned int burst;       // tokens in a full bucket
+    unsigned long epoch;      // nowUsec() / 1000 at startup
+    unsigned long limited;    // connections turned away
+    unsigned long untracked;  // let through because no slot was free
+    struct ratebucket buckets[RATE_SLOTS];
+};
+
+static void rateInit(struct ratelimit *rl, unsigned int rate,
+        unsigned int burst)
+{
+    rl->rate = rate;
+    rl->burst = burst;
+    rl->epoch = nowUsec() / 1000;
+}
+
+/*
+ * The key of a client address.  An IPv4 address counts as its
+ * IPv4-mapped IPv6 address, so both families share one table.
+ */
+static unsigned long rateKey(const struct sockaddr *sa)
+{
+    unsigned char addr[16] = { [10] = 0xff, [11] = 0xff };
+    unsigned long hi, lo, h;
+
+    if (sa->sa_family == AF_INET6)
+        memcpy(addr, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+    else if (sa->sa_family == AF_INET)
+        memcpy(addr + 12, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+    memcpy(&hi, addr, 8);
+    memcpy(&lo, addr + 8, 8);
+    h = hi ^ (lo * 0x9e3779b97f4a7c15UL);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9UL;
+    h ^= h >> 29;
+    return h > RATE_CLAIMING ? h : h + RATE_CLAIMING + 1;
+}
+
+/*
+ * The level of a bucket in thousandths of a token at time now, in
+ * milliseconds since the epoch.  A token a second is a thousandth a
+ * millisecond, so refilling is exact.
+ */
+static unsigned long rateLevel(struct ratelimit *rl, unsigned long state,
+        unsigned long now)
+{
+    unsigned long then = state >> RATE_LEVEL_BITS;
+    unsigned long level = state & RATE_LEVEL_MASK;
+    unsigned long full = rl->burst * 1000UL;
+
+    // another process may have stored a slightly later time
+    if (now > then)
+        level += (now - then) * rl->rate;
+    return level < full ? level : full;
+}
+
+// Find the slot of key, or claim a free one for it.  NULL if none is.
+static struct ratebucket *rateBucket(struct ratelimit *rl, unsigned long key,
+        unsigned long now)
+{
+    struct ratebucket *b;
+    unsigned long k;
+    int i;
+
+    for (i = 0; i < RATE_PROBES; i++) {
+        b = &rl->buckets[(key + i) & (RATE_SLOTS - 1)];
+        if (__atomic_load_n(&b->key, __ATOMIC_ACQUIRE) == key)
+            return b;
+    }
+    for (i = 0; i < RATE_PROBES; i++) {
+        b = &rl->buckets[(key + i) & (RATE_SLOTS - 1)];
+        k = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+        if (k == RATE_CLAIMING || (k != 0 && rateLevel(rl,
+                __atomic_load_n(&b->state, __ATOMIC_RELAXED), now) <
+                rl->burst * 1000UL))
+            continue;
+        if (!__atomic_compare_exchange_n(&b->key, &k, RATE_CLAIMING, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        __atomic_store_n(&b->state, now << RATE_LEVEL_BITS |
+                rl->burst * 1000UL, __ATOMIC_RELAXED);
+        __atomic_store_n(&b->key, key, __ATOMIC_RELEASE);
+        return b;
+    }
+    return NULL;
+}
+
+/*
+ * Take a token for a new connection from the client at sa.  Returns 1 if
+ * the connection may go ahead, and 0 if the client has to back off.
+ */
+static int rateAllow(struct ratelimit *rl, const struct sockaddr *sa)
+{
+    unsigned long now, state, level;
+    struct ratebucket *b;
+
+    if (rl->rate == 0)
+        return 1;
+    now = nowUsec() / 1000 - rl->epoch;
+    if ((b = rateBucket(rl, rateKey(sa), now)) == NULL) {
+        __atomic_add_fetch(&rl->untracked, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+    do {
+        level = rateLevel(rl, state, now);
+        if (level < 1000) {
+            __atomic_add_fetch(&rl->limited, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&b->state, &state,
+                now << RATE_LEVEL_BITS | (level - 1000), 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+ * Response counters by status class and latency histograms.  Every child
+ * has its own slot, starting on its own cache line, and bumps it with
+ * relaxed atomics, so no child ever waits for another one to count a
+ * response.  Readers add the slots up;
+ * the sum may miss a response that is being counted right now, which is
+ * fine for statistics.
+ *
+ * The slots are also the scoreboard that the parent sizes the pool by:
+ * a child says whether it is busy with a connection, and the parent tells
+ * it when to retire.
+ */
+struct reqstat {
+    // aligned so that each child starts on its own cache line
+    struct __attribute__((aligned(64))) {
+        unsigned long byClass[4]; // 2XX, 3XX, 4XX and 5XX responses
+        unsigned long bytesSent;  // headers and bodies
+        pid_t owner;              // child using the slot, 0 if none
+        int busy;                 // serving a connection, not in accept()
+        int retire;               // set by the parent: exit when idle
+        struct histogram latency[N_PHASES]; // in microseconds
+    } slot[CHILD_SLOTS];
+    struct ratelimit limiter; // shared by all children
+};
+
+static struct reqstat *area;
+static int statSlot; // this child's slot in area
+
+static void countResponse(struct reqstat *area, int statusCode)
+{
+    int class = statusCode / 100 - 2;
+    if (class >= 0 && class < 4)
+        __atomic_add_fetch(&area->slot[statSlot].byClass[class], 1, 
+                __ATOMIC_RELAXED);
+}
+
+// Count n bytes sent by this child.
+static void countBytesSent(ssize_t n)
+{
+    if (n > 0)
+        __atomic_add_fetch(&area->slot[statSlot].bytesSent, n, 
+                __ATOMIC_RELAXED);
+}
+
+static void sumStatistics(struct reqstat *area, unsigned long byClass[4])
+{
+    int i, j;
+
+    for (j = 0; j < 4; j++)
+        byClass[j] = 0;
+    for (i = 0; i < CHILD_SLOTS; i++)
+        for (j = 0; j < 4; j++)
+            byClass[j] += __atomic_load_n(&area->slot[i].byClass[j],
+                    __ATOMIC_RELAXED);
+}
+
+/*
+ * A new child takes the slot of a child that has exited, so the counts
+ * of the old child are kept.  The parent picks the slot before forking
+ * and frees it when it reaps the child.  Returns -1 if all are taken.
+ */
+static int findFreeSlot(struct reqstat *area)
+{
+    int i;
+
+    for (i = 0; i < CHILD_SLOTS; i++)
+        if (__atomic_load_n(&area->slot[i].owner, __ATOMIC_RELAXED) == 0)
+            return i;
+    return -1;
+}
+
+static void releaseStatSlot(struct reqstat *area, pid_t pid)
+{
+    int i;
+
+    for (i = 0; i < CHILD_SLOTS; i++)
+        if (area->slot[i].owner == pid)
+            __atomic_store_n(&area->slot[i].owner, 0, __ATOMIC_RELAXED);
+}
+
+// Has any child ever used slot i?
+static int slotUsed(struct reqstat *area, int i)
+{
+    unsigned long n[4];
+    int j;
+
+    if (__atomic_load_n(&area->slot[i].owner, __ATOMIC_RELAXED) != 0)
+        return 1;
+    for (j = 0; j < 4; j++)
+        n[j] = __atomic_load_n(&area->slot[i].byClass[j], __ATOMIC_RELAXED);
+    return n[0] + n[1] + n[2] + n[3] > 0;
+}
+
+struct poolcount {
+    int total;      // children running, retiring ones included
+    int idle;       // waiting in accept() and not retiring
+    int busy;       // serving a connection
+};
+
+static void countChildren(struct reqstat *area, struct poolcount *pc)
+{
+    int i;
+
+    pc->total = pc->idle = pc->busy = 0;
+    for (i = 0; i < CHILD_SLOTS; i++) {
+        if (__atomic_load_n(&area->slot[i].owner, __ATOMIC_RELAXED) == 0)
+            continue;
+        pc->total++;
+        if (__atomic_load_n(&area->slot[i].busy, __ATOMIC_RELAXED))
+            pc->busy++;
+        else if (!__atomic_load_n(&area->slot[i].retire, __ATOMIC_RELAXED))
+            pc->idle++;
+    }
+}
+
+static void recordLatency(struct reqstat *area, enum latency_phase phase, 
+        unsigned long usec)
+{
+    struct histogram *h = &area->slot[statSlot].latency[phase];
+
+    __atomic_add_fetch(&h->count[histBucket(usec)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->sum, usec, __ATOMIC_RELAXED);
+}
+
+// Add up the histograms of all children for phase.
+static unsigned long mergeLatency(struct reqstat *area, 
+        enum latency_phase phase, struct histogram *h)
+{
+    unsigned long total = 0;
+    int i, b;
+
+    memset(h, 0, sizeof(*h));
+    for (i = 0; i < CHILD_SLOTS; i++) {
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            unsigned long n = __atomic_load_n(
+                    &area->slot[i].latency[phase].count[b], __ATOMIC_RELAXED);
+            h->count[b] += n;
+            total += n;
+        }
+        h->sum += __atomic_load_n(&area->slot[i].latency[phase].sum, 
+                __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// The latency that percent of the total recorded values do not exceed.
+static unsigned long histPercentile(const struct histogram *h, 
+        unsigned long total, double percent)
+{
+    unsigned long rank = (unsigned long)(total * percent / 100.0 + 0.999999);
+    unsigned long seen = 0;
+    int b;
+
+    if (rank == 0)
+        rank = 1;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= rank)
+            return histBucketValue(b);
+    }
+    return histBucketValue(HIST_BUCKETS - 1);
+}
+
+/*
+ * Append one line per phase with the count and percentiles of the
+ * latencies of all children to buf.  Each line starts with prefix.
+ */
+static void formatLatency(char *buf, size_t size, struct reqstat *area, 
+        const char *prefix)
+{
+    struct histogram h;
+    int phase;
+
+    for (phase = 0; phase < N_PHASES; phase++) {
+        unsigned long total = mergeLatency(area, phase, &h);
+        size_t len = strlen(buf);
+        if (total == 0)
+            continue;
+        snprintf(buf + len, size - len, 
+                "%s%s : n=%lu p50=%lu p90=%lu p99=%lu p999=%lu us\n", 
+                prefix, phaseNames[phase], total, 
+                histPercentile(&h, total, 50), 
+                histPercentile(&h, total, 90), 
+                histPercentile(&h, total, 99), 
+                histPercentile(&h, total, 99.9));
+    }
+}
+
+static void sig_int(int signo){		/* signal handler */
+	key = 1;
+}
+
+/*
+ * Create a listening socket bound to the given port.
+ */
+static int createServerSocket(unsigned short port)
+{
+    int servSock;
+    struct sockaddr_in servAddr;
+
+    /* Create socket for incoming connections */
+    if ((servSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        die("socket() failed");
+      
+    /* Construct local address structure */
+    memset(&servAddr, 0, sizeof(servAddr));       /* Zero out structure */
+    servAddr.sin_family = AF_INET;                /* Internet address family */
+    servAddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
+    servAddr.sin_port = htons(port);              /* Local port */
+
+    /* Bind to the local address */
+    if (bind(servSock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0)
+        die("bind() failed");
+
+    /* Mark the socket so it will listen for incoming connections */
+    if (listen(servSock, MAXPENDING) < 0)
+        die("listen() failed");
+
+    return servSock;
+}
+
+/*
+ * A wrapper around send() that does error checking and logging.
+ * Returns -1 on failure.
+ * 
+ * This function assumes that buf is a null-terminated string, so
+ * don't use this function to send binary data.
+ */
+ssize_t Send(int sock, const char *buf)
+{
+    size_t len = strlen(buf);
+    ssize_t res = send(sock, buf, len, 0);
+    countBytesSent(res);
+    if (res != len) {
+        perror("send() failed");
+        return -1;
+    }
+    else 
+        return res;
+}
+
+/*
+ * Send len bytes from p, however many send() calls it takes.
+ * Returns -1 on failure.
+ */
+static int sendBuffer(int clntSock, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(clntSock, p, len, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("\nsend() failed");
+            return -1;
+        }
+        countBytesSent(n);
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Send everything in iov with writev(), however many calls it takes.
+ * iov is used up in the process.  Returns -1 on failure.
+ */
+static int sendIovec(int clntSock, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(clntSock, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("\nwritev() failed");
+            return -1;
+        }
+        countBytesSent(n);
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * HTTP/1.0 status codes and the corresponding reason phrases.
+ */
+
+static struct {
+    int status;
+    char *reason;
+} HTTP_StatusCodes[] = {
+    { 200, "OK" },
+    { 201, "Created" },
+    { 202, "Accepted" },
+    { 204, "No Content" },
+    { 301, "Moved Permanently" },
+    { 302, "Moved Temporarily" },
+    { 304, "Not Modified" },
+    { 400, "Bad Request" },
+    { 401, "Unauthorized" },
+    { 403, "Forbidden" },
+    { 404, "Not Found" },
+    { 429, "Too Many Requests" },
+    { 431, "Request Header Fields Too Large" },
+    { 500, "Internal Server Error" },
+    { 501, "Not Implemented" },
+    { 502, "Bad Gateway" },
+    { 503, "Service Unavailable" },
+    { 0, NULL } // marks the end of the list
+};
+
+/*
+ * Response templates.
+ *
+ * The status line and the HTML error body only depend on the status
+ * code, so responseInit() formats them once at startup.  The templates
+ * are indexed directly by status code, and sendStatusLine() sends one
+ * without a lookup or a sprintf(), adding only the Date line of the
+ * clock service.
+ */
+#define STATUS_CODE_MAX 600
+
+struct response_template {
+    const char *reason;
+    char statusLine[64];        // "HTTP/1.0 404 Not Found\r\n"
+    size_t statusLineLen;
+    char body[160];             // error page, empty for a 200
+    size_t bodyLen;
+};
+
+static struct response_template
+    responses[sizeof(HTTP_StatusCodes) / sizeof(HTTP_StatusCodes[0])];
+static struct response_template *responseByStatus[STATUS_CODE_MAX];
+
+/*
+ * Build the response templates.  Called once from main().
+ */
+static void responseInit(void)
+{
+    int i;
+
+    for (i = 0; HTTP_StatusCodes[i].status > 0; i++) {
+        struct response_template *t = &responses[i];
+        int status = HTTP_StatusCodes[i].status;
+
+        t->reason = HTTP_StatusCodes[i].reason;
+        t->statusLineLen = snprintf(t->statusLine, sizeof(t->statusLine),
+                "HTTP/1.0 %d %s\r\n", status, t->reason);
+
+        // For non-200 status, format the status line as an HTML content
+        // so that browers can display it.
+        if (status != 200)
+            t->bodyLen = snprintf(t->body, sizeof(t->body),
+                    "<html><body>\n"
+                    "<h1>%d %s</h1>\n"
+                    "</body></html>\n",
+                    status, t->reason);
+        responseByStatus[status] = t;
+    }
+}
+
+/*
+ * The template for statusCode.  We only send the codes listed in
+ * HTTP_StatusCodes; anything else goes out as a 500.
+ */
+static inline const struct response_template *responseFor(int statusCode)
+{
+    if (statusCode > 0 && statusCode < STATUS_CODE_MAX &&
+            responseByStatus[statusCode] != NULL)
+        return responseByStatus[statusCode];
+    return responseByStatus[500];
+}
+
+static inline const char *getReasonPhrase(int statusCode)
+{
+    if (statusCode > 0 && statusCode < STATUS_CODE_MAX &&
+            responseByStatus[statusCode] != NULL)
+        return responseByStatus[statusCode]->reason;
+    return "Unknown Status Code";
+}
+
+
+
+static void showstatistics(int clntSock, int statusCode, struct reqstat* area){
+    const struct response_template *t = responseFor(statusCode);
+    char body[STATS_PAGE_SIZE];
+    char dateLine[DATE_LINE_MAX];
+    char lengthLine[64];
+    struct iovec iov[4];
+    unsigned long n[4];
+
+    sumStatistics(area, n);
+
+    snprintf(body, sizeof(body),
+            "<html><body>\n"
+            "<h1>Request Statistics</h1>"
+            "Number of 2XX : %lu \n"
+            "<br>Number of 3XX : %lu \n"
+            "<br>Number of 4XX : %lu \n" 
+            "<br>Number of 5XX : %lu \n"
+            "<br>Sum : %lu \n"
+            "<br>Latency of all children :\n", n[0], n[1], n[2], n[3], n[0] + n[1] + n[2] + n[3]);
+    formatLatency(body, sizeof(body), area, "<br>");
+    strncat(body, "</body></html>\n", sizeof(body) - strlen(body) - 1);
+
+    // The status line comes from the template and the Date line from the
+    // clock service, as for every other response.
+    iov[0].iov_base = (void *)t->statusLine;
+    iov[0].iov_len = t->statusLineLen;
+    iov[1].iov_base = dateLine;
+    iov[1].iov_len = clockDateLine(dateLine);
+    iov[2].iov_base = lengthLine;
+    iov[2].iov_len = snprintf(lengthLine, sizeof(lengthLine), 
+            "Content-Length: %zu\r\n\r\n", strlen(body));
+    iov[3].iov_base = body;
+    iov[3].iov_len = strlen(body);
+    sendIovec(clntSock, iov, 4);
+}
+
+
+/*
+ * Point iov, which must hold 4 iovecs, at the HTTP status line and the
+ * Date header followed by a blank line, and the error page for a non-200
+ * status.  The Date line is formatted into dateLine.  Returns the number
+ * of iovecs used.  sendStatusLine() sends them with one writev().
+ */
+static int statusIovec(struct iovec *iov, char *dateLine, int statusCode)
+{
+    const struct response_template *t = responseFor(statusCode);
+    int cnt = 0;
+
+    iov[cnt].iov_base = (void *)t->statusLine;
+    iov[cnt++].iov_len = t->statusLineLen;
+    iov[cnt].iov_base = dateLine;
+    iov[cnt++].iov_len = clockDateLine(dateLine);
+
+    // We need to send a blank line to signal the end of headers.
+    iov[cnt].iov_base = "\r\n";
+    iov[cnt++].iov_len = 2;
+    if (t->bodyLen > 0) {
+        iov[cnt].iov_base = (void *)t->body;
+        iov[cnt++].iov_len = t->bodyLen;
+    }
+    return cnt;
+}
+
+static void sendStatusLine(int clntSock, int statusCode, struct reqstat* area)
+{
+    char dateLine[DATE_LINE_MAX];
+    struct iovec iov[4];
+
+    countResponse(area, statusCode);
+    sendIovec(clntSock, iov, statusIovec(iov, dateLine, statusCode));
+}
+
+/*
+ * Turn a client that is over its rate away with a 429, and close the
+ * connection.  Nothing here may block: the response is a single
+ * non-blocking sendmsg() of the template, which fits in any socket
+ * buffer.  Whatever part of the request has arrived is read first, so
+ * that close() sends a FIN rather than a reset that could discard the
+ * 429 at the client.  The response is only counted by the limiter, and
+ * not logged, so that a flood does not flood the log too.
+ */
+static void rejectConnection(int clntSock)
+{
+    static char discard[REQ_BUF_SIZE];
+    char dateLine[DATE_LINE_MAX];
+    struct iovec iov[4];
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = statusIovec(iov, dateLine, 429);
+    recv(clntSock, discard, sizeof(discard), MSG_DONTWAIT);
+    sendmsg(clntSock, &msg, MSG_DONTWAIT);
+    shutdown(clntSock, SHUT_WR);
+    close(clntSock);
+}
+
+/*
+ * Request parsing.
+ *
+ * A request is parsed straight out of the connection's read buffer, and
+ * httpParse() is called again every time more bytes arrive.  Until the
+ * blank line that ends the headers shows up it only scans the new bytes
+ * for it.  Then it splits the request line and the headers in place:
+ * every token is NUL-terminated where its separator was, and the request
+ * gets pointers and lengths into the buffer.  Nothing is copied.
+ */
+struct strview {
+    char *p;        // NUL-terminated once the request is parsed
+    size_t len;
+};
+
+struct http_header {
+    struct strview name;
+    struct strview value;   // without surrounding blanks
+};
+
+struct http_request {
+    struct strview method;
+    struct strview uri;
+    struct strview version;
+    struct http_header headers[REQ_MAX_HEADERS];
+    int nHeaders;
+    unsigned short lineEnd[REQ_MAX_HEADERS + 1]; // offsets of the newlines
+    int nLines;
+    size_t scanned;     // bytes already searched for newlines
+    size_t length;      // request line and headers, once complete
+};
+
+#define PARSE_INCOMPLETE (-1) /* httpParse() needs more bytes */
+#define PARSE_EOF (-2)        /* readRequest(): closed before a request */
+
+static void httpRequestInit(struct http_request *req)
+{
+    req->method.p = req->uri.p = req->version.p = "";
+    req->method.len = req->uri.len = req->version.len = 0;
+    req->nHeaders = 0;
+    req->nLines = 0;
+    req->scanned = 0;
+    req->length = 0;
+}
+
+/*
+ * Delimiter scanning.
+ *
+ * The parser spends its time looking for newlines (to find the lines and
+ * the blank line that ends the headers) and for blanks and colons (to
+ * split a line).  Both are done 16 or 32 bytes at a time with SSE2/AVX2
+ * compares and SSE4.2 PCMPESTRI when the CPU has them; scanInit() picks
+ * the versions once at startup.  The scalar versions are the fallback
+ * and are what runs on other architectures.
+ */
+
+/*
+ * Note the newline at buf[i].  It ends the request line or a header
+ * line, or the headers if the line is blank.  Returns the length of the
+ * header block when buf[i] ends it, 0 otherwise, and -1 if req has no
+ * room for another line.  Whether a line is blank only depends on bytes
+ * before the newline, so a newline never has to be looked at twice.
+ */
+static inline long noteLineEnd(struct http_request *req, const char *buf,
+        size_t i)
+{
+    size_t start = req->nLines ? req->lineEnd[req->nLines - 1] + 1u : 0;
+
+    if (i == start || (i == start + 1 && buf[start] == '\r'))
+        return i + 1;
+    if (req->nLines == REQ_MAX_HEADERS + 1)
+        return -1;
+    req->lineEnd[req->nLines++] = i;
+    return 0;
+}
+
+/*
+ * Record the line ends in buf[req->scanned..len) and stop at the blank
+ * line.  Returns what noteLineEnd() returned for it, or 0 if the
+ * headers have not ended yet.
+ */
+static long scanLinesScalar(struct http_request *req, const char *buf,
+        size_t len)
+{
+    const char *p = buf + req->scanned;
+    const char *end = buf + len;
+    long r;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        if ((r = noteLineEnd(req, buf, p - buf)) != 0)
+            return r;
+        p++;
+    }
+    req->scanned = len;
+    return 0;
+}
+
+// The first byte of p[0..end) that is one of the n bytes of set, or end.
+static char *findCharScalar(char *p, char *end, const char *set, int n)
+{
+    for (; p < end; p++)
+        if (memchr(set, *p, n) != NULL)
+            return p;
+    return end;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static long scanLinesSse2(struct http_request *req, const char *buf,
+        size_t len)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = req->scanned;
+    long r;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        for (; mask != 0; mask &= mask - 1)
+            if ((r = noteLineEnd(req, buf, i + __builtin_ctz(mask))) != 0)
+                return r;
+    }
+    req->scanned = i;
+    return scanLinesScalar(req, buf, len);
+}
+
+__attribute__((target("avx2")))
+static long scanLinesAvx2(struct http_request *req, const char *buf,
+        size_t len)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = req->scanned;
+    long r;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        for (; mask != 0; mask &= mask - 1)
+            if ((r = noteLineEnd(req, buf, i + __builtin_ctz(mask))) != 0)
+                return r;
+    }
+    req->scanned = i;
+    return scanLinesScalar(req, buf, len);
+}
+
+// set holds at most 16 bytes.
+__attribute__((target("sse4.2")))
+static char *findCharSse42(char *p, char *end, const char *set, int n)
+{
+    char padded[16] = { 0 };
+    memcpy(padded, set, n);
+    const __m128i s = _mm_loadu_si128((const __m128i *)padded);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int i = _mm_cmpestri(s, n, v, 16, _SIDD_UBYTE_OPS |
+                _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16)
+            return p + i;
+    }
+    return findCharScalar(p, end, set, n);
+}
+#endif
+
+static long (*scanLines)(struct http_request *req, const char *buf,
+        size_t len) = scanLinesScalar;
+static char *(*findChar)(char *p, char *end, const char *set, int n) =
+    findCharScalar;
+
+/*
+ * Pick the fastest scanners this CPU supports.  Called once from main()
+ * before any request is parsed.
+ */
+static void scanInit(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scanLines = scanLinesAvx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scanLines = scanLinesSse2;
+    if (__builtin_cpu_supports("sse4.2"))
+        findChar = findCharSse42;
+#endif
+}
+
+// Cut the next token off *s, which ends at end.
+static struct strview nextToken(char **s, char *end)
+{
+    struct strview v;
+    char *p = *s;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    v.p = p;
+    p = findChar(p, end, " \t", 2);
+    v.len = p - v.p;
+    *s = p;
+    return v;
+}
+
+/*
+ * Split the line buf[0..len) (without its line end) into the request
+ * line tokens of req.  Returns 0, or the HTTP status code to send.
+ */
+static int parseRequestLine(struct http_request *req, char *line,
+        size_t len)
+{
+    char *end = line + len;
+    char *p = line;
+
+    req->method = nextToken(&p, end);
+    req->uri = nextToken(&p, end);
+    req->version = nextToken(&p, end);
+    struct strview extraThingsOnRequestLine = nextToken(&p, end);
+
+    // check if we have 3 (and only 3) things in the request line
+    if (req->method.len == 0 || req->uri.len == 0 ||
+            req->version.len == 0 || extraThingsOnRequestLine.len != 0) {
+        req->method.p = req->uri.p = req->version.p = "";
+        return 501; // "Not Implemented"
+    }
+    req->method.p[req->method.len] = '\0';
+    req->uri.p[req->uri.len] = '\0';
+    req->version.p[req->version.len] = '\0';
+    return 0;
+}
+
+/*
+ * Split one header line buf[0..len) (without its line end) into name
+ * and value.  Returns 0, or the HTTP status code to send.
+ */
+static int parseHeader(struct http_request *req, char *line, size_t len)
+{
+    char *end = line + len;
+    char *colon = findChar(line, end, ":", 1);
+
+    // no whitespace is allowed between the name and the colon
+    if (colon == end || colon == line ||
+            colon[-1] == ' ' || colon[-1] == '\t')
+        return 400; // "Bad Request"
+
+    struct http_header *h = &req->headers[req->nHeaders++];
+    char *value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    h->name.p = line;
+    h->name.len = colon - line;
+    h->value.p = value;
+    h->value.len = end - value;
+    *colon = '\0';
+    *end = '\0';
+    return 0;
+}
+
+/*
+ * Parse the request at the start of buf, of which len bytes have arrived
+ * so far.  req must have been set up with httpRequestInit() and passed
+ * in again, unchanged, together with the same buf when more bytes are
+ * in.  Returns 0 when the request is complete (req->length bytes of buf
+ * belong to it), PARSE_INCOMPLETE if the headers have not ended yet, or
+ * the HTTP status code to answer a broken request with.
+ */
+static int httpParse(struct http_request *req, char *buf, size_t len)
+{
+    long end = scanLines(req, buf, len);
+    if (end == 0)
+        return PARSE_INCOMPLETE;
+    if (end < 0)
+        return 431; // "Request Header Fields Too Large"
+    req->length = end;
+    if (req->nLines == 0)
+        return 501; // "Not Implemented"; no request line at all
+
+    size_t start = 0;
+    int i;
+    for (i = 0; i < req->nLines; i++) {
+        char *line = buf + start;
+        size_t n = req->lineEnd[i] - start;
+        if (n > 0 && line[n - 1] == '\r')
+            n--;
+        int status = i == 0 ? parseRequestLine(req, line, n) :
+            parseHeader(req, line, n);
+        if (status != 0)
+            return status;
+        start = req->lineEnd[i] + 1;
+    }
+    return 0;
+}
+
+/*
+ * The value of header name (case-insensitive) in req, or NULL if the
+ * request has no such header.
+ */
+static const char *httpHeader(const struct http_request *req,
+        const char *name)
+{
+    size_t len = strlen(name);
+    int i;
+
+    for (i = 0; i < req->nHeaders; i++)
+        if (req->headers[i].name.len == len &&
+                strcasecmp(req->headers[i].name.p, name) == 0)
+            return req->headers[i].value.p;
+    return NULL;
+}
+
+/*
+ * Check that we can serve the parsed request.
+ * Returns 0 if the request line is acceptable, or the HTTP status code
+ * that should be sent to the browser otherwise.
+ */
+static int checkRequestLine(const struct http_request *req)
+{
+    // we only support GET method
+    if (strcmp(req->method.p, "GET") != 0)
+        return 501; // "Not Implemented"
+
+    // we only support HTTP/1.0 and HTTP/1.1
+    if (strcmp(req->version.p, "HTTP/1.0") != 0 &&
+        strcmp(req->version.p, "HTTP/1.1") != 0)
+        return 501; // "Not Implemented"
+
+    // requestURI must begin with "/"
+    if (req->uri.p[0] != '/')
+        return 400; // "Bad Request"
+
+    // make sure that the requestURI does not contain "/../" and
+    // does not end with "/..", which would be a big security hole!
+    if (req->uri.len >= 3) {
+        char *tail = req->uri.p + (req->uri.len - 3);
+        if (strcmp(tail, "/..") == 0 ||
+                strstr(req->uri.p, "/../") != NULL)
+            return 400; // "Bad Request"
+    }
+
+    return 0;
+}
+
+/*
+ * Read buffer of a blocking connection.  The current request is parsed
+ * in place; whatever was pipelined after it stays for the next one.
+ */
+struct reqbuf {
+    char data[REQ_BUF_SIZE];
+    size_t start;   // first byte of the current request
+    size_t next;    // first byte after it
+    size_t len;     // bytes in data
+};
+
+static void reqbufInit(struct reqbuf *rb)
+{
+    rb->start = rb->next = rb->len = 0;
+}
+
+/*
+ * Read and parse the next request on the blocking socket sock.
+ * Returns 0 when req holds it, PARSE_EOF if the connection was closed
+ * or timed out before the request began, or the HTTP status code to
+ * answer a broken request with.  *started is set to the time the first
+ * byte of the request was there, for the parse latency.
+ */
+static int readRequest(int sock, struct reqbuf *rb, struct http_request *req,
+        unsigned long *started)
+{
+    rb->start = rb->next;
+    if (rb->start == rb->len)
+        rb->start = rb->next = rb->len = 0;
+    httpRequestInit(req);
+    *started = 0;
+
+    for (;;) {
+        if (rb->len > rb->start) {
+            if (*started == 0)
+                *started = nowUsec();
+            int status = httpParse(req, rb->data + rb->start,
+                    rb->len - rb->start);
+            if (status != PARSE_INCOMPLETE) {
+                rb->next = status == 0 ? rb->start + req->length : rb->len;
+                return status;
+            }
+        }
+        if (rb->len == sizeof(rb->data)) {
+            if (rb->start == 0) {
+                rb->next = rb->len;
+                return 431; // "Request Header Fields Too Large"
+            }
+            // make room by moving the partial request to the front
+            memmove(rb->data, rb->data + rb->start, rb->len - rb->start);
+            rb->len -= rb->start;
+            rb->start = 0;
+        }
+        ssize_t n = recv(sock, rb->data + rb->len,
+                sizeof(rb->data) - rb->len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            rb->next = rb->len;
+            // socket closed prematurely - there isn't much we can do
+            return rb->len == rb->start ? PARSE_EOF : 400;
+        }
+        rb->len += n;
+    }
+}
+
+/*
+ * Copy the file to the socket through a user space buffer.
+ * This is the slow path for files that sendfile() and splice() refuse.
+ * Returns -1 on failure.
+ */
+static int copyFileBody(int clntSock, int fd)
+{
+    ssize_t n;
+    char buf[DISK_IO_BUF_SIZE];
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        ssize_t m = send(clntSock, buf, n, 0);
+        countBytesSent(m);
+        if (m != n) {
+            // send() failed.
+            // We log the failure, break out of the loop,
+            // and let the server continue on with the next request.
+            perror("\nsend() failed");
+            return -1;
+        }
+    }
+    if (n < 0) {
+        perror("read failed");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Move the file to the socket through a pipe with splice(), so the data
+ * never has to be copied into user space.  Used for anything that is not
+ * a regular file (sendfile() only reads from regular files).
+ * Returns -1 on failure.
+ */
+static int spliceFileBody(int clntSock, int fd)
+{
+    int pfd[2];
+    ssize_t n, m;
+
+    if (pipe(pfd) < 0) {
+        perror("pipe failed");
+        return copyFileBody(clntSock, fd);
+    }
+
+    for (;;) {
+        n = splice(fd, NULL, pfd[1], NULL, SPLICE_PIPE_SIZE, 
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(pfd[0]);
+            close(pfd[1]);
+            // the file does not support splice; copy it instead
+            if (errno == EINVAL)
+                return copyFileBody(clntSock, fd);
+            perror("splice failed");
+            return -1;
+        }
+        // drain the pipe into the socket
+        while (n > 0) {
+            m = splice(pfd[0], NULL, clntSock, NULL, n, 
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m <= 0) {
+                if (m < 0 && errno == EINTR)
+                    continue;
+                perror("\nsplice() to socket failed");
+                close(pfd[0]);
+                close(pfd[1]);
+                return -1;
+            }
+            countBytesSent(m);
+            n -= m;
+        }
+    }
+
+    close(pfd[0]);
+    close(pfd[1]);
+    return 0;
+}
+
+/*
+ * Send the body of an open file without copying it through user space:
+ * sendfile() for regular files, splice() for everything else.
+ * Returns -1 on failure.
+ */
+static int sendFileBody(int clntSock, int fd, const struct stat *st)
+{
+    if (!S_ISREG(st->st_mode))
+        return spliceFileBody(clntSock, fd);
+
+    off_t remaining = st->st_size;
+    while (remaining > 0) {
+        ssize_t n = sendfile(clntSock, fd, NULL, remaining);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // nothing sent yet and sendfile() is not supported here
+            if ((errno == EINVAL || errno == ENOSYS) && 
+                    remaining == st->st_size)
+                return spliceFileBody(clntSock, fd);
+            perror("\nsendfile() failed");
+            return -1;
+        }
+        if (n == 0) // file was truncated under us
+            break;
+        countBytesSent(n);
+        remaining -= n;
+    }
+    return 0;
+}
+
+/*
+ * Turn TCP_CORK on or off.  While the socket is corked the kernel only
+ * sends full segments, so the status line goes out in the same packet
+ * as the beginning of the file.
+ */
+static void setCork(int clntSock, int on)
+{
+    setsockopt(clntSock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/*
+ * Shared file cache.
+ *
+ * Small static files are kept in a MAP_SHARED region that the parent
+ * creates before forking, so every child serves a hot file straight from
+ * memory once any child has read it.  The region starts with a table of
+ * CACHE_ENTRIES entries followed by the data arena of cacheBudget bytes.
+ *
+ * The table has its own lock, cache->lock, which every child takes to
+ * look up, reserve or release an entry; nothing else in the shared
+ * region depends on it.  A child holds a reference on an entry while it
+ * sends from it, so the entry can't be evicted under its feet.
+ *
+ * A child may die at any point, so the cache must not depend on it
+ * finishing what it started.  The lock is a robust process-shared
+ * mutex: if its holder dies, the next child to lock it gets it anyway.
+ * A child holds at most one entry at a time, a reference or an entry
+ * it is loading, and records it in its holder slot.  When the parent
+ * reaps a child, cacheReclaim() drops what the child held, so a killed
+ * child doesn't pin its entry and arena space for good.  Eviction uses the
+ * CLOCK algorithm.  An entry is checked against the file's mtime and
+ * size at most once every CACHE_REVALIDATE_SECS, so hits usually don't
+ * need any system call at all.
+ *
+ * A file's entry lives in one of the CACHE_PROBES slots starting at its
+ * home slot, hash & (CACHE_ENTRIES - 1), so a lookup looks at no more
+ * than those.  The free parts of the arena are kept as a list of holes
+ * sorted by offset, which an insert takes its space from and a freed
+ * entry gives its space back to.  The holes follow from the entries, so
+ * if a child dies while changing them, they are worked out again from
+ * the entries.
+ */
+
+enum cache_state {
+    CACHE_FREE,
+    CACHE_LOADING, // reserved by a child that is reading the file
+    CACHE_VALID,
+};
+
+struct cache_entry {
+    int state;
+    int refs;           // children currently sending from this entry
+    int referenced;     // CLOCK bit, set on every hit
+    unsigned int hash;
+    char path[CACHE_PATH_MAX];
+    off_t size;
+    struct timespec mtime;
+    time_t checked;     // monotonic seconds of the last stat()
+    size_t offset;      // where the data starts in the arena
+};
+
+struct filecache {
+    pthread_mutex_t lock;
+    size_t budget;      // size of the data arena
+    unsigned int hand;  // CLOCK hand
+    unsigned long hits;
+    unsigned long misses;
+    unsigned int nholes;
+    struct cache_hole {
+        size_t offset;
+        size_t len;
+    } holes[CACHE_ENTRIES + 1]; // free arena space, sorted by offset
+    struct cache_holder {
+        pid_t pid;      // child holding an entry, 0 if none
+        int entry;      // index of that entry
+    } holders[CHILD_SLOTS];      // indexed by statSlot
+    struct cache_entry entries[CACHE_ENTRIES];
+};
+
+static struct filecache *cache;
+
+static char *cacheData(struct filecache *cache)
+{
+    return (char *)(cache + 1);
+}
+
+static int compareOffsets(const void *a, const void *b)
+{
+    const struct cache_entry *x = *(const struct cache_entry **)a;
+    const struct cache_entry *y = *(const struct cache_entry **)b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * Work out the holes in the arena from the entries that use it.
+ * Called with cache->lock held.
+ */
+static void cacheFindHoles(struct filecache *cache)
+{
+    struct cache_entry *used[CACHE_ENTRIES];
+    int n = 0, i;
+    size_t start = 0;
+
+    for (i = 0; i < CACHE_ENTRIES; i++)
+        if (cache->entries[i].state != CACHE_FREE)
+            used[n++] = &cache->entries[i];
+    qsort(used, n, sizeof(used[0]), compareOffsets);
+
+    cache->nholes = 0;
+    for (i = 0; i <= n; i++) {
+        size_t end = i < n ? used[i]->offset : cache->budget;
+        if (end > start) {
+            cache->holes[cache->nholes].offset = start;
+            cache->holes[cache->nholes].len = end - start;
+            cache->nholes++;
+        }
+        if (i < n && used[i]->offset + used[i]->size > start)
+            start = used[i]->offset + used[i]->size;
+    }
+}
+
+static void cacheLock(struct filecache *cache)
+{
+    int err = pthread_mutex_lock(&cache->lock);
+
+    // Its last holder died.  An entry it was changing is put right by
+    // cacheReclaim() when the parent reaps it, and the holes may be
+    // half updated.
+    if (err == EOWNERDEAD) {
+        err = pthread_mutex_consistent(&cache->lock);
+        cacheFindHoles(cache);
+    }
+    if (err != 0)
+        die("pthread_mutex_lock failed");
+}
+
+static void cacheUnlock(struct filecache *cache)
+{
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Record that this child holds e.  Called with cache->lock held.
+static void cacheHold(struct filecache *cache, struct cache_entry *e)
+{
+    cache->holders[statSlot].entry = e - cache->entries;
+    cache->holders[statSlot].pid = getpid();
+}
+
+// This child no longer holds an entry.  Called with cache->lock held.
+static void cacheUnhold(struct filecache *cache)
+{
+    cache->holders[statSlot].pid = 0;
+}
+
+static unsigned int cacheHash(const char *path)
+{
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*path)
+        h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h;
+}
+
+// The i-th slot a file with this hash may use.
+static struct cache_entry *cacheSlot(struct filecache *cache, 
+        unsigned int hash, int i)
+{
+    return &cache->entries[(hash + i) & (CACHE_ENTRIES - 1)];
+}
+
+/*
+ * Mark e free and give its space back to the arena.
+ * Called with cache->lock held.
+ */
+static void cacheFree(struct filecache *cache, struct cache_entry *e)
+{
+    struct cache_hole *h = cache->holes;
+    size_t end = e->offset + e->size;
+    unsigned int lo = 0, hi = cache->nholes, mid;
+
+    e->state = CACHE_FREE;
+    if (e->size == 0)
+        return;
+
+    // the first hole after e
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (h[mid].offset < e->offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0 && h[lo - 1].offset + h[lo - 1].len == e->offset) {
+        h[lo - 1].len += e->size;
+        if (lo < cache->nholes && h[lo].offset == end) {
+            h[lo - 1].len += h[lo].len;
+            memmove(&h[lo], &h[lo + 1], 
+                    (cache->nholes - lo - 1) * sizeof(h[0]));
+            cache->nholes--;
+        }
+    }
+    else if (lo < cache->nholes && h[lo].offset == end) {
+        h[lo].offset = e->offset;
+        h[lo].len += e->size;
+    }
+    else {
+        memmove(&h[lo + 1], &h[lo], (cache->nholes - lo) * sizeof(h[0]));
+        h[lo].offset = e->offset;
+        h[lo].len = e->size;
+        cache->nholes++;
+    }
+}
+
+/*
+ * Map the shared cache region; called by the parent before forking.
+ */
+static struct filecache *cacheCreate(size_t budget)
+{
+    struct filecache *c;
+
+    c = mmap(0, sizeof(struct filecache) + budget, PROT_READ | PROT_WRITE, 
+            MAP_ANON | MAP_SHARED, -1, 0);
+    if (c == MAP_FAILED)
+        die("mmap error");
+    // anonymous memory is zeroed, so every entry starts out CACHE_FREE
+    c->budget = budget;
+    c->holes[0].len = budget;
+    c->nholes = 1;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&c->lock, &attr) != 0)
+        die("pthread_mutex_init failed");
+    pthread_mutexattr_destroy(&attr);
+    return c;
+}
+
+/*
+ * Drop the reference or the half-loaded entry that child pid held when
+ * it died.  Called by the parent when it reaps the child.
+ */
+static void cacheReclaim(struct filecache *cache, pid_t pid)
+{
+    int i;
+
+    cacheLock(cache);
+    for (i = 0; i < CHILD_SLOTS; i++) {
+        struct cache_holder *h = &cache->holders[i];
+        if (h->pid != pid)
+            continue;
+        struct cache_entry *e = &cache->entries[h->entry];
+        e->refs--;
+        if (e->state == CACHE_LOADING)
+            cacheFree(cache, e); // only the loader had it
+        else if (e->refs == 0 && e->path[0] == '\0')
+            cacheFree(cache, e); // invalidated while it was sending
+        h->pid = 0;
+    }
+    cacheUnlock(cache);
+}
+
+/*
+ * Look up path.  On a hit, returns the entry with a reference held;
+ * the caller sends the data and then calls cacheRelease().
+ * Must not be called with cache->lock held.
+ */
+static struct cache_entry *cacheLookup(struct filecache *cache, 
+        const char *path)
+{
+    unsigned int hash = cacheHash(path);
+    struct cache_entry *e = NULL;
+    int i;
+
+    cacheLock(cache);
+    for (i = 0; i < CACHE_PROBES; i++) {
+        e = cacheSlot(cache, hash, i);
+        if (e->state == CACHE_VALID && e->hash == hash && 
+                strcmp(e->path, path) == 0)
+            break;
+    }
+    if (i == CACHE_PROBES) {
+        cache->misses++;
+        cacheUnlock(cache);
+        return NULL;
+    }
+    e->refs++;
+    e->referenced = 1;
+    cacheHold(cache, e);
+    cacheUnlock(cache);
+
+    // Make sure the file has not changed since we last looked.
+    time_t now = clockSeconds();
+    if (now - e->checked >= CACHE_REVALIDATE_SECS) {
+        struct stat st;
+        int stale = stat(path, &st) != 0 || !S_ISREG(st.st_mode) || 
+            st.st_size != e->size || 
+            st.st_mtim.tv_sec != e->mtime.tv_sec || 
+            st.st_mtim.tv_nsec != e->mtime.tv_nsec;
+
+        cacheLock(cache);
+        if (stale) {
+            // Hide it from lookups; the space is freed once the last
+            // child sending from it is done.
+            e->refs--;
+            cacheUnhold(cache);
+            e->hash = 0;
+            e->path[0] = '\0';
+            if (e->refs == 0)
+                cacheFree(cache, e);
+            cache->misses++;
+            cacheUnlock(cache);
+            return NULL;
+        }
+        e->checked = now;
+        cacheUnlock(cache);
+    }
+
+    __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+    return e;
+}
+
+static void cacheRelease(struct filecache *cache, struct cache_entry *e)
+{
+    cacheLock(cache);
+    e->refs--;
+    cacheUnhold(cache);
+    if (e->refs == 0 && e->path[0] == '\0')
+        cacheFree(cache, e); // invalidated while we were sending
+    cacheUnlock(cache);
+}
+
+/*
+ * Take len bytes from the first hole in the arena that has them.
+ * Returns the offset or -1.  Called with cache->lock held.
+ */
+static long cacheFindSpace(struct filecache *cache, size_t len)
+{
+    struct cache_hole *h = cache->holes;
+    unsigned int i;
+    size_t offset;
+
+    if (len == 0)
+        return 0;
+    for (i = 0; i < cache->nholes; i++) {
+        if (h[i].len < len)
+            continue;
+        offset = h[i].offset;
+        h[i].offset += len;
+        h[i].len -= len;
+        if (h[i].len == 0) {
+            memmove(&h[i], &h[i + 1], 
+                    (cache->nholes - i - 1) * sizeof(h[0]));
+            cache->nholes--;
+        }
+        return offset;
+    }
+    return -1;
+}
+
+/*
+ * Give e a CLOCK turn: evict it unless it is being sent or has been used
+ * since its last turn.  Returns 1 if it was evicted.
+ * Called with cache->lock held.
+ */
+static int cacheClockTurn(struct filecache *cache, struct cache_entry *e)
+{
+    if (e->state != CACHE_VALID || e->refs > 0)
+        return 0;
+    if (e->referenced) {
+        e->referenced = 0;
+        return 0;
+    }
+    cacheFree(cache, e);
+    return 1;
+}
+
+/*
+ * Evict one entry with the CLOCK algorithm: skip entries that are being
+ * sent and give recently used ones a second chance.
+ * Returns 0 if nothing could be evicted.
+ * Called with cache->lock held.
+ */
+static int cacheEvictOne(struct filecache *cache)
+{
+    int i;
+
+    for (i = 0; i < 2 * CACHE_ENTRIES; i++) {
+        struct cache_entry *e = &cache->entries[cache->hand];
+        cache->hand = (cache->hand + 1) % CACHE_ENTRIES;
+        if (cacheClockTurn(cache, e))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Free a slot for a file with this hash, evicting one of the entries in
+ * its slots the same way.  Returns the slot or NULL.
+ * Called with cache->lock held.
+ */
+static struct cache_entry *cacheEvictSlot(struct filecache *cache, 
+        unsigned int hash)
+{
+    int i;
+
+    for (i = 0; i < 2 * CACHE_PROBES; i++) {
+        struct cache_entry *e = cacheSlot(cache, hash, i % CACHE_PROBES);
+        if (cacheClockTurn(cache, e))
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * Add the open regular file fd to the cache under path.
+ * Silently does nothing if the file does not fit.
+ */
+static void cacheInsert(struct filecache *cache, const char *path, int fd, 
+        const struct stat *st)
+{
+    struct cache_entry *e = NULL;
+    unsigned int hash = cacheHash(path);
+    long offset;
+    int i;
+
+    if (strlen(path) >= CACHE_PATH_MAX || 
+            st->st_size > cache->budget / CACHE_MAX_FILE_FRACTION)
+        return;
+
+    cacheLock(cache);
+    for (i = 0; i < CACHE_PROBES; i++) {
+        struct cache_entry *x = cacheSlot(cache, hash, i);
+        if (x->state != CACHE_FREE && x->hash == hash && 
+                strcmp(x->path, path) == 0)
+            goto out; // another child got here first
+        if (x->state == CACHE_FREE && e == NULL)
+            e = x;
+    }
+    if (e == NULL && (e = cacheEvictSlot(cache, hash)) == NULL)
+        goto out;
+    while ((offset = cacheFindSpace(cache, st->st_size)) < 0)
+        if (!cacheEvictOne(cache))
+            goto out;
+
+    // Reserve the space, then read the file without holding the lock.
+    e->size = st->st_size;
+    e->offset = offset;
+    e->state = CACHE_LOADING;
+    e->refs = 1;
+    e->referenced = 0;
+    e->hash = hash;
+    strcpy(e->path, path);
+    e->mtime = st->st_mtim;
+    e->checked = clockSeconds();
+    cacheHold(cache, e);
+    cacheUnlock(cache);
+
+    size_t done = 0;
+    while (done < st->st_size) {
+        ssize_t n = pread(fd, cacheData(cache) + offset + done, 
+                st->st_size - done, done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+
+    cacheLock(cache);
+    e->refs = 0;
+    cacheUnhold(cache);
+    if (done == st->st_size)
+        e->state = CACHE_VALID;
+    else
+        cacheFree(cache, e);
+out:
+    cacheUnlock(cache);
+}
 
-#define N_CHILDREN 4
-static void die(const char *message)
+/*
+ * Send the cached data of e.  Returns -1 on failure.
+ */
+static int cacheSend(struct filecache *cache, struct cache_entry *e, 
+        int clntSock)
 {
-    perror(message);
-    exit(1); 
+    return sendBuffer(clntSock, cacheData(cache) + e->offset, e->size);
 }
 
-static int key;
+/*
+ * Directory listings.
+ *
+ * A directory is rendered to HTML by the child itself with opendir() and
+ * readdir(), so a listing no longer costs a fork() and an exec() of ls,
+ * and it is never truncated.  Each child keeps the last DIRCACHE_ENTRIES
+ * listings it rendered, keyed by directory path.  A listing stays valid
+ * while the directory keeps its inode and mtime: adding, removing or
+ * renaming an entry updates the mtime.
+ */
+struct dircache_entry {
+    int inUse;
+    unsigned int hash;         // cacheHash() of path
+    unsigned long lastUsed;    // for LRU replacement
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char path[CACHE_PATH_MAX];
+    char *html;
+    size_t len;
+};
 
-struct reqstat {
-    sem_t sem;
-    int num_two;
-    int num_three;
-    int num_four;
-    int num_five;
+static struct dircache_entry dircache[DIRCACHE_ENTRIES];
+static unsigned long dircacheClock;
+
+// A growing output buffer.
+struct strbuf {
+    char *buf;
+    size_t len;
+    size_t cap;
 };
 
-static struct reqstat *area;
+static void sbAppend(struct strbuf *sb, const char *s, size_t n)
+{
+    if (sb->len + n > sb->cap) {
+        size_t cap = sb->cap ? sb->cap : 4096;
+        while (sb->len + n > cap)
+            cap *= 2;
+        if ((sb->buf = (char *)realloc(sb->buf, cap)) == NULL)
+            die("realloc failed");
+        sb->cap = cap;
+    }
+    memcpy(sb->buf + sb->len, s, n);
+    sb->len += n;
+}
 
-static void sig_int(int signo){		/* signal handler */
-	key = 1;
+static void sbAppendStr(struct strbuf *sb, const char *s)
+{
+    sbAppend(sb, s, strlen(s));
+}
+
+// Append s with the characters that are special in HTML escaped.
+static void sbAppendHtml(struct strbuf *sb, const char *s)
+{
+    for (; *s; s++) {
+        switch (*s) {
+            case '&': sbAppendStr(sb, "&amp;"); break;
+            case '<': sbAppendStr(sb, "&lt;"); break;
+            case '>': sbAppendStr(sb, "&gt;"); break;
+            case '"': sbAppendStr(sb, "&quot;"); break;
+            case '\'': sbAppendStr(sb, "&#39;"); break;
+            default: sbAppend(sb, s, 1);
+        }
+    }
+}
+
+static int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
 }
 
 /*
- * Create a listening socket bound to the given port.
+ * Render the listing of the directory at path, which was requested as
+ * requestURI, into sb.  Returns -1 if the directory can't be read.
  */
-static int createServerSocket(unsigned short port)
+static int renderDirectory(const char *path, const char *requestURI, 
+        struct strbuf *sb)
 {
-    int servSock;
-    struct sockaddr_in servAddr;
+    DIR *dir = opendir(path);
+    struct dirent *d;
+    char **names = NULL;
+    size_t nNames = 0, capNames = 0, i;
 
-    /* Create socket for incoming connections */
-    if ((servSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-        die("socket() failed");
-      
-    /* Construct local address structure */
-    memset(&servAddr, 0, sizeof(servAddr));       /* Zero out structure */
-    servAddr.sin_family = AF_INET;                /* Internet address family */
-    servAddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
-    servAddr.sin_port = htons(port);              /* Local port */
-
-    /* Bind to the local address */
-    if (bind(servSock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0)
-        die("bind() failed");
+    if (dir == NULL)
+        return -1;
 
-    /* Mark the socket so it will listen for incoming connections */
-    if (listen(servSock, MAXPENDING) < 0)
-        die("listen() failed");
+    // Directory names carry a trailing '/'.
+    while ((d = readdir(dir)) != NULL) {
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+        int isDir = d->d_type == DT_DIR;
+        if (d->d_type == DT_UNKNOWN) {
+            struct stat st;
+            isDir = fstatat(dirfd(dir), d->d_name, &st, 0) == 0 && 
+                S_ISDIR(st.st_mode);
+        }
+        if (nNames == capNames) {
+            capNames = capNames ? capNames * 2 : 64;
+            names = (char **)realloc(names, capNames * sizeof(*names));
+            if (names == NULL)
+                die("realloc failed");
+        }
+        size_t n = strlen(d->d_name);
+        if ((names[nNames] = (char *)malloc(n + 2)) == NULL)
+            die("malloc failed");
+        memcpy(names[nNames], d->d_name, n);
+        strcpy(names[nNames] + n, isDir ? "/" : "");
+        nNames++;
+    }
+    closedir(dir);
+    qsort(names, nNames, sizeof(*names), compareNames);
+
+    // The links are absolute because the URI of this directory has no
+    // trailing '/'.  Neither have the links to subdirectories: a
+    // trailing '/' asks for the index.html.
+    sbAppendStr(sb, "<html><head><title>Index of ");
+    sbAppendHtml(sb, requestURI);
+    sbAppendStr(sb, "</title></head><body>\n<h1>Index of ");
+    sbAppendHtml(sb, requestURI);
+    sbAppendStr(sb, "</h1>\n<ul>\n");
+    for (i = 0; i < nNames; i++) {
+        sbAppendStr(sb, "<li><a href=\"");
+        sbAppendHtml(sb, requestURI);
+        sbAppendStr(sb, "/");
+        char *slash = strchr(names[i], '/');
+        if (slash)
+            *slash = '\0';
+        sbAppendHtml(sb, names[i]);
+        if (slash)
+            *slash = '/';
+        sbAppendStr(sb, "\">");
+        sbAppendHtml(sb, names[i]);
+        sbAppendStr(sb, "</a></li>\n");
+        free(names[i]);
+    }
+    sbAppendStr(sb, "</ul>\n</body></html>\n");
+    free(names);
+    return 0;
+}
 
-    return servSock;
+/*
+ * Find the listing of the directory at path, described by st.  Returns
+ * NULL on a miss or if the directory has changed since it was rendered.
+ */
+static struct dircache_entry *dircacheLookup(const char *path, 
+        const struct stat *st)
+{
+    unsigned int hash = cacheHash(path);
+    int i;
+
+    for (i = 0; i < DIRCACHE_ENTRIES; i++) {
+        struct dircache_entry *e = &dircache[i];
+        if (!e->inUse || e->hash != hash || strcmp(e->path, path) != 0)
+            continue;
+        if (e->dev != st->st_dev || e->ino != st->st_ino || 
+                e->mtime.tv_sec != st->st_mtim.tv_sec || 
+                e->mtime.tv_nsec != st->st_mtim.tv_nsec) {
+            free(e->html);
+            e->inUse = 0;
+            return NULL;
+        }
+        e->lastUsed = ++dircacheClock;
+        return e;
+    }
+    return NULL;
 }
 
 /*
- * A wrapper around send() that does error checking and logging.
- * Returns -1 on failure.
- * 
- * This function assumes that buf is a null-terminated string, so
- * don't use this function to send binary data.
+ * Keep the listing in sb for the directory at path.  On success the
+ * cache owns sb->buf and 0 is returned.
  */
-ssize_t Send(int sock, const char *buf)
+static int dircacheInsert(const char *path, const struct stat *st, 
+        struct strbuf *sb)
 {
-    size_t len = strlen(buf);
-    ssize_t res = send(sock, buf, len, 0);
-    if (res != len) {
-        perror("send() failed");
+    struct dircache_entry *victim = &dircache[0];
+    int i;
+
+    if (strlen(path) >= CACHE_PATH_MAX || sb->len > DIRCACHE_MAX_LISTING)
         return -1;
+
+    // The mtime may not have ticked yet for a change made right now, and
+    // a later change in the same tick would go unnoticed.
+    if (clockWallSeconds() - st->st_mtim.tv_sec < 2)
+        return -1;
+
+    // take a free slot, or else the least recently used one
+    for (i = 0; i < DIRCACHE_ENTRIES; i++) {
+        if (!dircache[i].inUse) {
+            victim = &dircache[i];
+            break;
+        }
+        if (dircache[i].lastUsed < victim->lastUsed)
+            victim = &dircache[i];
     }
-    else 
-        return res;
+    if (victim->inUse)
+        free(victim->html);
+
+    victim->inUse = 1;
+    victim->hash = cacheHash(path);
+    victim->lastUsed = ++dircacheClock;
+    victim->dev = st->st_dev;
+    victim->ino = st->st_ino;
+    victim->mtime = st->st_mtim;
+    strcpy(victim->path, path);
+    victim->html = sb->buf;
+    victim->len = sb->len;
+    return 0;
 }
 
 /*
- * HTTP/1.0 status codes and the corresponding reason phrases.
+ * Send the listing of the directory at path, described by st.
+ * Returns the HTTP status code that was sent to the browser.
  */
+static int list_directory(int clntSock, const char *path, 
+        const char *requestURI, const struct stat *st, struct reqstat *area)
+{
+    struct strbuf sb = { NULL, 0, 0 };
+    const char *html;
+    size_t len;
+
+    struct dircache_entry *e = dircacheLookup(path, st);
+    if (e != NULL) {
+        html = e->html;
+        len = e->len;
+    }
+    else {
+        if (renderDirectory(path, requestURI, &sb) < 0) {
+            sendStatusLine(clntSock, 403, area);
+            return 403; // "Forbidden"
+        }
+        html = sb.buf;
+        len = sb.len;
+        if (dircacheInsert(path, st, &sb) == 0)
+            sb.buf = NULL; // the cache owns it now
+    }
 
-static struct {
-    int status;
-    char *reason;
-} HTTP_StatusCodes[] = {
-    { 200, "OK" },
-    { 201, "Created" },
-    { 202, "Accepted" },
-    { 204, "No Content" },
-    { 301, "Moved Permanently" },
-    { 302, "Moved Temporarily" },
-    { 304, "Not Modified" },
-    { 400, "Bad Request" },
-    { 401, "Unauthorized" },
-    { 403, "Forbidden" },
-    { 404, "Not Found" },
-    { 500, "Internal Server Error" },
-    { 501, "Not Implemented" },
-    { 502, "Bad Gateway" },
-    { 503, "Service Unavailable" },
-    { 0, NULL } // marks the end of the list
+    setCork(clntSock, 1);
+    sendStatusLine(clntSock, 200, area);
+    sendBuffer(clntSock, html, len);
+    setCork(clntSock, 0);
+    free(sb.buf);
+    return 200; // "OK"
+}
+
+/*
+ * Machine-readable statistics.
+ *
+ * Besides the HTML page, /statistics is served as JSON or in the
+ * Prometheus text exposition format, chosen by ?format=json or
+ * ?format=prometheus, or else by the Accept header.  Everything is read
+ * from the shared regions with relaxed atomic loads, so a scrape never
+ * waits for, or holds up, a child that is serving requests.
+ */
+enum stats_format {
+    STATS_HTML,
+    STATS_JSON,
+    STATS_PROMETHEUS,
 };
 
-static inline const char *getReasonPhrase(int statusCode)
+// The format asked for by the value of an Accept header.
+static enum stats_format statsFormatFromAccept(const char *accept)
 {
-    int i = 0;
-    while (HTTP_StatusCodes[i].status > 0) {
-        if (HTTP_StatusCodes[i].status == statusCode)
-            return HTTP_StatusCodes[i].reason;
-        i++;
-    }
-    return "Unknown Status Code";
+    if (strcasestr(accept, "application/json"))
+        return STATS_JSON;
+    if (strcasestr(accept, "text/plain"))
+        return STATS_PROMETHEUS;
+    return STATS_HTML;
 }
 
+// The format asked for by the query string of a /statistics request.
+static enum stats_format statsFormatFromQuery(const char *query, 
+        enum stats_format format)
+{
+    if (strstr(query, "format=json"))
+        return STATS_JSON;
+    if (strstr(query, "format=prometheus"))
+        return STATS_PROMETHEUS;
+    if (strstr(query, "format=html"))
+        return STATS_HTML;
+    return format;
+}
 
+static void sbPrintf(struct strbuf *sb, const char *format, ...)
+{
+    char line[512];
+    va_list ap;
+
+    va_start(ap, format);
+    int n = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(line))
+        n = sizeof(line) - 1;
+    if (n > 0)
+        sbAppend(sb, line, n);
+}
 
-static void showstatistics(int clntSock, int statusCode, struct reqstat* area){
-     char buf[1000];
-    // const char *reasonPhrase = getReasonPhrase(statusCode);
-
-    // print the status line into the buffer
-    sprintf(buf, "HTTP/1.0 %d ", statusCode);
-    // strcat(buf, "you called stat");
-    strcat(buf, "\r\n");
+static unsigned long loadRelaxed(unsigned long *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
 
-    // We don't send any HTTP header in this simple server.
-    // We need to send a blank line to signal the end of headers.
-    strcat(buf, "\r\n");
+static void renderStatsJson(struct strbuf *sb, struct reqstat *area)
+{
+    struct histogram h;
+    unsigned long n[4];
+    int i, phase;
+
+    struct poolcount pc;
+    const char *sep = "";
+
+    sbAppendStr(sb, "{\n  \"children\": [");
+    for (i = 0; i < CHILD_SLOTS; i++) {
+        unsigned long *byClass = area->slot[i].byClass;
+        if (!slotUsed(area, i))
+            continue;
+        sbPrintf(sb, "%s\n    {\"child\": %d, \"responses\": {\"2xx\": %lu, "
+                "\"3xx\": %lu, \"4xx\": %lu, \"5xx\": %lu}, "
+                "\"bytes_sent\": %lu}",
+                sep, i, loadRelaxed(&byClass[0]), loadRelaxed(&byClass[1]),
+                loadRelaxed(&byClass[2]), loadRelaxed(&byClass[3]),
+                loadRelaxed(&area->slot[i].bytesSent));
+        sep = ",";
+    }
+    sbAppendStr(sb, "\n  ],\n");
+
+    countChildren(area, &pc);
+    sbPrintf(sb, "  \"pool\": {\"children\": %d, \"idle\": %d, "
+            "\"busy\": %d},\n", pc.total, pc.idle, pc.busy);
+
+    sumStatistics(area, n);
+    sbPrintf(sb, "  \"responses\": {\"2xx\": %lu, \"3xx\": %lu, "
+            "\"4xx\": %lu, \"5xx\": %lu},\n", n[0], n[1], n[2], n[3]);
+
+    if (cache) {
+        unsigned long hits = loadRelaxed(&cache->hits);
+        unsigned long misses = loadRelaxed(&cache->misses);
+        sbPrintf(sb, "  \"file_cache\": {\"hits\": %lu, \"misses\": %lu, "
+                "\"hit_ratio\": %.4f},\n", hits, misses, 
+                hits + misses ? (double)hits / (hits + misses) : 0.0);
+    }
+    else
+        sbAppendStr(sb, "  \"file_cache\": null,\n");
+    sbPrintf(sb, "  \"log_dropped\": %lu,\n", loadRelaxed(&logShared->dropped));
+    sbPrintf(sb, "  \"rate_limit\": {\"rate\": %u, \"burst\": %u, "
+            "\"limited\": %lu, \"untracked\": %lu},\n",
+            area->limiter.rate, area->limiter.burst,
+            loadRelaxed(&area->limiter.limited),
+            loadRelaxed(&area->limiter.untracked));
+
+    sbAppendStr(sb, "  \"latency_us\": {\n");
+    for (phase = 0; phase < N_PHASES; phase++) {
+        unsigned long total = mergeLatency(area, phase, &h);
+        sbPrintf(sb, "    \"%s\": {\"count\": %lu, \"sum\": %lu, "
+                "\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu}%s\n", 
+                phaseKeys[phase], total, h.sum, 
+                total ? histPercentile(&h, total, 50) : 0, 
+                total ? histPercentile(&h, total, 90) : 0, 
+                total ? histPercentile(&h, total, 99) : 0, 
+                total ? histPercentile(&h, total, 99.9) : 0, 
+                phase < N_PHASES - 1 ? "," : "");
+    }
+    sbAppendStr(sb, "  }\n}\n");
+}
 
-    // For non-200 status, format the status line as an HTML content
-    // so that browers can display it.
-    // if (statusCode != 200) {
-        char body[1000];
-        sprintf(body,
-		"<html><body>\n"	
-                "<h1>Request Statistics</h1>"
-                "Number of 2XX : %d \n"
-                "<br>Number of 3XX : %d \n"
-                "<br>Number of 4XX : %d \n" 
-                "<br>Number of 5XX : %d \n"
-                "<br>Sum : %d \n"      
-                "</body></html>\n", area->num_two, area->num_three, area->num_four, area->num_five, area->num_two + area->num_three + area->num_four + area->num_five);
-            strcat(buf, body);
-    // }
+static void renderStatsPrometheus(struct strbuf *sb, struct reqstat *area)
+{
+    static const char *classes[4] = { "2xx", "3xx", "4xx", "5xx" };
+    struct histogram h;
+    struct poolcount pc;
+    int i, j, phase;
+
+    sbAppendStr(sb,
+            "# HELP multiserver_responses_total Responses sent, by child and status class.\n"
+            "# TYPE multiserver_responses_total counter\n");
+    for (i = 0; i < CHILD_SLOTS; i++)
+        for (j = 0; j < 4 && slotUsed(area, i); j++)
+            sbPrintf(sb, "multiserver_responses_total{child=\"%d\",class=\"%s\"} %lu\n", 
+                    i, classes[j], loadRelaxed(&area->slot[i].byClass[j]));
+
+    sbAppendStr(sb, 
+            "# HELP multiserver_sent_bytes_total Bytes sent to clients, by child.\n"
+            "# TYPE multiserver_sent_bytes_total counter\n");
+    for (i = 0; i < CHILD_SLOTS; i++)
+        if (slotUsed(area, i))
+            sbPrintf(sb, "multiserver_sent_bytes_total{child=\"%d\"} %lu\n",
+                    i, loadRelaxed(&area->slot[i].bytesSent));
+
+    countChildren(area, &pc);
+    sbPrintf(sb,
+            "# HELP multiserver_children Children in the pool, by state.\n"
+            "# TYPE multiserver_children gauge\n"
+            "multiserver_children{state=\"idle\"} %d\n"
+            "multiserver_children{state=\"busy\"} %d\n"
+            "multiserver_children{state=\"retiring\"} %d\n",
+            pc.idle, pc.busy, pc.total - pc.idle - pc.busy);
+
+    sbPrintf(sb, 
+            "# HELP multiserver_log_dropped_total Access log lines dropped because a log ring was full.\n"
+            "# TYPE multiserver_log_dropped_total counter\n"
+            "multiserver_log_dropped_total %lu\n", 
+            loadRelaxed(&logShared->dropped));
+
+    sbPrintf(sb, 
+            "# HELP multiserver_rate_limited_total Connections turned away with a 429 because their client was over its rate.\n"
+            "# TYPE multiserver_rate_limited_total counter\n"
+            "multiserver_rate_limited_total %lu\n"
+            "# HELP multiserver_rate_untracked_total Connections let through because the rate limiter had no slot for their client.\n"
+            "# TYPE multiserver_rate_untracked_total counter\n"
+            "multiserver_rate_untracked_total %lu\n",
+            loadRelaxed(&area->limiter.limited),
+            loadRelaxed(&area->limiter.untracked));
+
+    if (cache) {
+        sbPrintf(sb, 
+                "# HELP multiserver_file_cache_hits_total Requests served from the shared file cache.\n"
+                "# TYPE multiserver_file_cache_hits_total counter\n"
+                "multiserver_file_cache_hits_total %lu\n"
+                "# HELP multiserver_file_cache_misses_total Shared file cache lookups that missed.\n"
+                "# TYPE multiserver_file_cache_misses_total counter\n"
+                "multiserver_file_cache_misses_total %lu\n", 
+                loadRelaxed(&cache->hits), loadRelaxed(&cache->misses));
+    }
 
-    // send the buffer to the browser
-    Send(clntSock, buf);
+    // Bucket boundaries are the powers of two from 1us to 2^32us, which
+    // are also boundaries of our log-linear buckets.
+    sbAppendStr(sb, 
+            "# HELP multiserver_phase_latency_seconds Time spent in each phase of a request.\n"
+            "# TYPE multiserver_phase_latency_seconds histogram\n");
+    for (phase = 0; phase < N_PHASES; phase++) {
+        unsigned long total = mergeLatency(area, phase, &h);
+        unsigned long below = 0;
+        int b = 0, k;
+        for (k = 0; k <= 32; k++) {
+            while (b < HIST_BUCKETS && histBucketValue(b) < (1UL << k))
+                below += h.count[b++];
+            sbPrintf(sb, "multiserver_phase_latency_seconds_bucket"
+                    "{phase=\"%s\",le=\"%.6f\"} %lu\n", 
+                    phaseKeys[phase], (1UL << k) / 1e6, below);
+        }
+        sbPrintf(sb, 
+                "multiserver_phase_latency_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n"
+                "multiserver_phase_latency_seconds_sum{phase=\"%s\"} %.6f\n"
+                "multiserver_phase_latency_seconds_count{phase=\"%s\"} %lu\n", 
+                phaseKeys[phase], total, phaseKeys[phase], h.sum / 1e6, 
+                phaseKeys[phase], total);
+    }
 }
 
-
 /*
- * Send HTTP status line followed by a blank line.
+ * Send the statistics in format.  Returns -1 on failure.
  */
-static void sendStatusLine(int clntSock, int statusCode, struct reqstat* area)
+static int sendStatistics(int clntSock, enum stats_format format, 
+        struct reqstat *area)
 {
-    char buf[1000];
-    const char *reasonPhrase = getReasonPhrase(statusCode);
-    int startnum;
-    int semres;  
-    semres = sem_wait(&(area->sem)); // check return value it is waiting the sem to be larger than 0
-    while(EINTR == semres){
-        fprintf(stdout, "interrupted here");
-        semres = sem_wait(&(area->sem));
-    }
-    startnum = statusCode/100;
-    if(startnum == 2){
-        area->num_two += 1;
+    struct strbuf sb = { NULL, 0, 0 };
+    const char *contentType;
+    char header[256];
+    char dateLine[DATE_LINE_MAX];
+    int res;
+
+    if (format == STATS_HTML) {
+        showstatistics(clntSock, 200, area);
+        return 0;
     }
-    else if(startnum == 3){
-        area->num_three += 1;
+    if (format == STATS_JSON) {
+        renderStatsJson(&sb, area);
+        contentType = "application/json";
     }
-    else if(startnum == 4){
-        area->num_four += 1;
+    else {
+        renderStatsPrometheus(&sb, area);
+        contentType = "text/plain; version=0.0.4; charset=utf-8";
     }
-    else if(startnum == 5){
-        area->num_five += 1;
-    }
-    sem_post(&(area->sem));
-    // print the status line into the buffer
-    sprintf(buf, "HTTP/1.0 %d ", statusCode);
-    strcat(buf, reasonPhrase);
-    strcat(buf, "\r\n");
 
-    // We don't send any HTTP header in this simple server.
-    // We need to send a blank line to signal the end of headers.
-    strcat(buf, "\r\n");
-
-    // For non-200 status, format the status line as an HTML content
-    // so that browers can display it.
-    if (statusCode != 200) {
-        char body[1000];
-        sprintf(body, 
-                "<html><body>\n"
-                "<h1>%d %s</h1>\n"
-                "</body></html>\n",
-                statusCode, reasonPhrase);
-        strcat(buf, body);
-    }
-
-    // send the buffer to the browser
-    Send(clntSock, buf);
-}
-
-static void list_directory(int clntSock, char *path){ // path is the path of the directory
-	int fd[2]; //0: read end; 1: write end
-	pid_t pid;
-	char line[1000];
-	char command[1000];
-	char cmd1[1000];
-       	char cmd2[1000];
-	strcpy(command, "/bin/ls");
-	strcpy(cmd1, "ls");
-	strcpy(cmd2, "-al");
-	// strcat(command, path);
-
-	if (pipe(fd) < 0)
-		die("pipe error");
-	if ((pid = fork()) < 0) {
-		die("fork error");
-	} else if (pid == 0) {
-		/* child process */
-        // close(fd[0]);
-        dup2(fd[1],2);
-        dup2(fd[1],1);
-        close(fd[1]);
-		execlp(command ,cmd1 , cmd2, path, (char *) 0);
-		die("can't do ls command");
-	} else {
-		/* parent process */
-		// close(fd[1]);
-		read(fd[0], line, 1000);
-		close(fd[0]);
-		fflush(stdout);
-		Send(clntSock, line);
-	}
+    clockDateLine(dateLine);
+    sprintf(header, "HTTP/1.0 200 OK\r\n"
+            "%s"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "\r\n", 
+            dateLine, contentType, sb.len);
+    setCork(clntSock, 1);
+    res = Send(clntSock, header) < 0 ? -1 : sendBuffer(clntSock, sb.buf, sb.len);
+    setCork(clntSock, 0);
+    free(sb.buf);
+    return res;
 }
 
-
-
 /*
  * Handle static file requests.
  * Returns the HTTP status code that was sent to the browser.
  */
 static int handleFileRequest(
-        const char *webRoot, const char *requestURI, int clntSock, struct reqstat* area)
+        const char *webRoot, const char *requestURI, int clntSock, struct reqstat* area, 
+        enum stats_format statsFormat)
 {
     int statusCode;
-    FILE *fp = NULL;
+    int fd = -1;
 
     // Compose the file path from webRoot and requestURI.
     // If requestURI ends with '/', append "index.html".
     
     char *file = (char *)malloc(strlen(webRoot) + strlen(requestURI) + 100);
 
-    char statistics[11] = "/statistics";
-    int semres;
-    file = (char *)malloc(strlen(webRoot) + strlen(requestURI) + 100);
-    if(strcmp(statistics, requestURI) == 0){ // send statistics
+    if (strncmp(requestURI, "/statistics", 11) == 0 && 
+            (requestURI[11] == '\0' || requestURI[11] == '?')) { // send statistics
         statusCode = 200;
-        semres = sem_wait(&(area->sem)); 
-        while(EINTR == semres){
-            fprintf(stdout, "interrupted here");
-            semres = sem_wait(&(area->sem));
-        }
-        area -> num_two += 1;
-        sem_post(&(area->sem));
-        showstatistics(clntSock, statusCode, area);
+        countResponse(area, statusCode);
+        if (requestURI[11] == '?')
+            statsFormat = statsFormatFromQuery(requestURI + 12, statsFormat);
+        sendStatistics(clntSock, statsFormat, area);
         goto func_end;
     }
 
+    unsigned long start = nowUsec();
+
     if (file == NULL)
         die("malloc failed");
     strcpy(file, webRoot);
@@ -295,295 +2711,403 @@ static int handleFileRequest(
     }
 
 
+    // Serve hot files straight from the shared cache.
+    struct cache_entry *ce = cache ? cacheLookup(cache, file) : NULL;
+    if (ce != NULL) {
+        statusCode = 200; // "OK"
+        recordLatency(area, PHASE_OPEN, nowUsec() - start);
+        start = nowUsec();
+        setCork(clntSock, 1);
+        sendStatusLine(clntSock, statusCode, area);
+        cacheSend(cache, ce, clntSock);
+        setCork(clntSock, 0);
+        recordLatency(area, PHASE_SEND, nowUsec() - start);
+        cacheRelease(cache, ce);
+        goto func_end;
+    }
+
     // See if the requested file is a directory.
-    // Our server does not support directory listing.
     struct stat st;
     if (stat(file, &st) == 0 && S_ISDIR(st.st_mode)) {
-	    statusCode = 200; // "OK"
-        semres = sem_wait(&(area->sem)); 
-        while(EINTR == semres){
-            fprintf(stdout, "interrupted here");
-            semres = sem_wait(&(area->sem));
-        }
-        area -> num_two += 1;
-        sem_post(&(area->sem));
-        list_directory(clntSock, file);
+        statusCode = list_directory(clntSock, file, requestURI, &st, area);
         goto func_end;
     }
 
     // If unable to open the file, send "404 Not Found".
 
-    fp = fopen(file, "rb");
-    if (fp == NULL) {
+    fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
         statusCode = 404; // "Not Found"
+        recordLatency(area, PHASE_OPEN, nowUsec() - start);
         sendStatusLine(clntSock, statusCode, area);
         goto func_end;
     }
 
     // Otherwise, send "200 OK" followed by the file content.
+    // Cork the socket so that the status line and the beginning of the
+    // body share a packet.
+
+    // Keep a copy for the next request, in this or any other child.
+    if (cache && S_ISREG(st.st_mode))
+        cacheInsert(cache, file, fd, &st);
+    recordLatency(area, PHASE_OPEN, nowUsec() - start);
 
     statusCode = 200; // "OK"
+    start = nowUsec();
+    setCork(clntSock, 1);
     sendStatusLine(clntSock, statusCode, area);
 
     // send the file 
-    size_t n;
-    char buf[DISK_IO_BUF_SIZE];
-    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
-        if (send(clntSock, buf, n, 0) != n) {
-            // send() failed.
-            // We log the failure, break out of the loop,
-            // and let the server continue on with the next request.
-            perror("\nsend() failed");
-            break;
-        }
-    }
-    // fread() returns 0 both on EOF and on error.
-    // Let's check if there was an error.
-    if (ferror(fp))
-        perror("fread failed");
+    sendFileBody(clntSock, fd, &st);
+    setCork(clntSock, 0);
+    recordLatency(area, PHASE_SEND, nowUsec() - start);
 
 func_end:
 
     // clean up
     free(file);
-    if (fp)
-        fclose(fp);
+    if (fd >= 0)
+        close(fd);
 
     return statusCode;
 }
 
+static volatile sig_atomic_t retiring; // a child: the parent told us to exit
 
+static void sig_retire(int signo)
+{
+    retiring = 1;
+}
 
-int main(int argc, char *argv[])
-{ 
-    // Ignore SIGPIPE so that we don't terminate when we call
-    // send() on a disconnected socket.
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
-        die("signal() failed");
+static int shouldRetire(void)
+{
+    return retiring ||
+        __atomic_load_n(&area->slot[statSlot].retire, __ATOMIC_RELAXED);
+}
 
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <server_port> <web_root>\n", argv[0]);
-        exit(1);
-    }
+/*
+ * The life of a child: accept connections on servSock and serve one
+ * request on each, until the parent retires us.  The parent sends
+ * SIGUSR2 to break us out of accept(); the signal is blocked while we
+ * serve a connection, so that it never interrupts a read or a send.
+ */
+static void serveClients(int servSock, const char *webRoot)
+{
+    struct reqbuf *rb;
+    struct http_request req;
+    int statusCode;
+    struct sockaddr_storage clntAddr; // room for any family rateKey() reads
+    struct sigaction act;
+    sigset_t usr2;
 
-    unsigned short servPort = atoi(argv[1]);
-    const char *webRoot = argv[2];
+    // SIGUSR1 is for the parent
+    if (signal(SIGUSR1, SIG_IGN) == SIG_ERR)
+        die("signal error");
+    act.sa_handler = sig_retire;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0; // no SA_RESTART: accept() must return EINTR
+    if (sigaction(SIGUSR2, &act, NULL) < 0)
+        die("signal error");
 
-    int servSock = createServerSocket(servPort);
+    // The logger thread inherits the blocked SIGUSR2, so the signal can
+    // only go to the thread that sits in accept().
+    sigemptyset(&usr2);
+    sigaddset(&usr2, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &usr2, NULL);
+    logStart();
 
-    char line[1000];
-    char requestLine[1000];
-    int statusCode;
-    struct sockaddr_in clntAddr;
-    int semres;
+    rb = (struct reqbuf *)malloc(sizeof(*rb));
+    if (rb == NULL)
+        die("malloc failed");
+    for (;;) {
+        /*
+         * wait for a client to connect
+         */
+        pthread_sigmask(SIG_UNBLOCK, &usr2, NULL);
+        if (shouldRetire())
+            break;
+        // initialize the in-out parameter
+        unsigned int clntLen = sizeof(clntAddr);
+        int clntSock = accept(servSock, (struct sockaddr *)&clntAddr, 
+                &clntLen);
+        if (clntSock < 0) {
+            if (errno == EINTR)
+                continue;
+            die("accept failed");
+        }
+        pthread_sigmask(SIG_BLOCK, &usr2, NULL);
+        if (!rateAllow(&area->limiter, (struct sockaddr *)&clntAddr)) {
+            rejectConnection(clntSock);
+            continue;
+        }
+        __atomic_store_n(&area->slot[statSlot].busy, 1, __ATOMIC_RELAXED);
+
+        /*
+         * Let's read and parse the request line and headers.
+         */
+
+        unsigned long parseStart;
+        enum stats_format statsFormat = STATS_HTML;
+        const char *accept;
+
+        reqbufInit(rb);
+        statusCode = readRequest(clntSock, rb, &req, &parseStart);
+        if (statusCode == PARSE_EOF) {
+            // socket closed - there isn't much we can do
+            statusCode = 400; // "Bad Request"
+            goto loop_end;
+        }
+        if (statusCode == 0)
+            statusCode = checkRequestLine(&req);
+        if (statusCode != 0) {
+            sendStatusLine(clntSock, statusCode, area);
+            goto loop_end;
+        }
 
-    // int status;
-    pid_t pid;
+        // Of the headers, we only look at Accept.
+        if ((accept = httpHeader(&req, "Accept")) != NULL)
+            statsFormat = statsFormatFromAccept(accept);
 
-    key = 0;	// which means that we skip the send stat in parent process
+        /*
+         * At this point, we have a well-formed HTTP GET request.
+         * Let's handle it.
+         */
 
-    if((area = mmap(0, sizeof(struct reqstat), PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0)) == MAP_FAILED)
-    die("mmap error");
-    area -> num_two = 0;
-    area -> num_three = 0;
-    area -> num_four = 0;
-    area -> num_five = 0;
-    sem_init(&(area->sem), 1, 1);
+        recordLatency(area, PHASE_PARSE, nowUsec() - parseStart);
+        statusCode = handleFileRequest(webRoot, req.uri.p, clntSock, area, 
+                statsFormat);
 
-    struct sigaction act, oact;
-    act.sa_handler = sig_int;
-    sigemptyset(&act.sa_mask);
-    act.sa_flags = 0;
-    if (sigaction(SIGUSR1, &act, &oact) < 0)
-        die("signal error");
-    if(signal(SIGUSR1, SIG_IGN) < 0)
-        die("ignore error");
-    //if (signal(SIGUSR1, sig_int) == SIG_ERR)
-//		die("signal error");
-    for(int i = 0; i < N_CHILDREN; i++){   
-forkhere:
-        if ((pid = fork()) < 0){
-            die("fork error");
-        }else if (pid == 0){ // child
-            for (;;) {
-                /*
-                * wait for a client to connect
-                */
-                // initialize the in-out parameter
-            unsigned int clntLen = sizeof(clntAddr); 
-            int clntSock;
-            clntLen = sizeof(clntAddr);
-                clntSock = accept(servSock, (struct sockaddr *)&clntAddr, &clntLen);
-            
-            if (clntSock < 0) {
-                die("accept failed");
-            }
+loop_end:
 
-            FILE *clntFp = fdopen(clntSock, "r");
-            if (clntFp == NULL)
-                die("fdopen failed");
+        /*
+         * Done with client request.
+         * Log it, close the client socket, and go back to accepting
+         * connection.
+         */
 
-            //     if ((pid = fork()) < 0){
-            // 	die("fork error");
-            // }else if (pid == 0){	/* child */
+        logPrintf("%s (%d) \"%s %s %s\" %d %s\n",
+                inet_ntoa(((struct sockaddr_in *)&clntAddr)->sin_addr),
+                getpid(),
+                req.method.p,
+                req.uri.p,
+                req.version.p,
+                statusCode,
+                getReasonPhrase(statusCode));
 
-            // cose the serve socket
-            // close(servSock);
+        // close the client socket 
+        close(clntSock);
+        __atomic_store_n(&area->slot[statSlot].busy, 0, __ATOMIC_RELAXED);
+    }
+    free(rb);
+}
 
-            /*
-            * Let's parse the request line.
-            */
+/*
+ * Fork a child into a free scoreboard slot.  The parent owns the slot
+ * from here until it reaps the child.  Returns -1 if no slot is free.
+ */
+static pid_t spawnChild(int servSock, const char *webRoot)
+{
+    int slot = findFreeSlot(area);
+    pid_t pid;
 
-            char *method      = "";
-            char *requestURI  = "";
-            char *httpVersion = "";
+    if (slot < 0)
+        return -1;
+    area->slot[slot].busy = 0;
+    area->slot[slot].retire = 0;
+    if ((pid = fork()) < 0)
+        die("fork error");
+    if (pid == 0) { // child
+        statSlot = slot;
+        serveClients(servSock, webRoot);
+        logDrain();
+        exit(0);
+    }
+    __atomic_store_n(&area->slot[slot].owner, pid, __ATOMIC_RELAXED);
+    return pid;
+}
 
-            if (fgets(requestLine, sizeof(requestLine), clntFp) == NULL) {
-                // socket closed - there isn't much we can do
-                statusCode = 400; // "Bad Request"
-                goto loop_end;
+/*
+ * One round of pool maintenance in the parent, once every
+ * MAINTENANCE_MSEC: fork children when fewer than minSpare are idle,
+ * retire one when more than maxSpare are.  Like Apache, we fork 1, 2,
+ * 4, ... children in successive rounds while we stay short of idle ones,
+ * so a burst of load does not set off a fork storm.
+ */
+static void maintainPool(int servSock, const char *webRoot, int minSpare, 
+        int maxSpare, int maxChildren)
+{
+    static int spawnRate = 1;
+    static int warned;
+    struct poolcount pc;
+    int i;
+
+    countChildren(area, &pc);
+    if (pc.idle > maxSpare) {
+        for (i = 0; i < CHILD_SLOTS; i++) {
+            pid_t pid = area->slot[i].owner;
+            if (pid != 0 && !area->slot[i].busy && !area->slot[i].retire) {
+                __atomic_store_n(&area->slot[i].retire, 1, __ATOMIC_RELAXED);
+                kill(pid, SIGUSR2);
+                break;
             }
+        }
+        spawnRate = 1;
+    }
+    else if (pc.idle < minSpare) {
+        int n = minSpare - pc.idle;
+        if (n > spawnRate)
+            n = spawnRate;
+        if (n > maxChildren - pc.total)
+            n = maxChildren - pc.total;
+        if (n <= 0 && !warned) {
+            fprintf(stderr, "server reached %d children, "
+                    "consider raising -n\n", maxChildren);
+            warned = 1;
+        }
+        for (i = 0; i < n; i++)
+            if (spawnChild(servSock, webRoot) < 0)
+                break;
+        if (spawnRate < MAX_SPAWN_RATE)
+            spawnRate *= 2;
+    }
+    else
+        spawnRate = 1;
+
+    // A retiring child may have missed the signal on its way into accept().
+    for (i = 0; i < CHILD_SLOTS; i++) {
+        pid_t pid = area->slot[i].owner;
+        if (pid != 0 && area->slot[i].retire)
+            kill(pid, SIGUSR2);
+    }
+}
 
-            char *token_separators = "\t \r\n"; // tab, space, new line
-            method = strtok(requestLine, token_separators);
-            requestURI = strtok(NULL, token_separators);
-            httpVersion = strtok(NULL, token_separators);
-            char *extraThingsOnRequestLine = strtok(NULL, token_separators);
-
-            // check if we have 3 (and only 3) things in the request line
-            if (!method || !requestURI || !httpVersion || 
-                extraThingsOnRequestLine) {
-                statusCode = 501; // "Not Implemented"
-                sendStatusLine(clntSock, statusCode, area);
-                goto loop_end;
-            }
 
-            // we only support GET method 
-            if (strcmp(method, "GET") != 0) {
-                statusCode = 501; // "Not Implemented"
-                sendStatusLine(clntSock, statusCode, area);
-                goto loop_end;
-            }
+int main(int argc, char *argv[])
+{ 
+    // Ignore SIGPIPE so that we don't terminate when we call
+    // send() on a disconnected socket.
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        die("signal() failed");
 
-            // we only support HTTP/1.0 and HTTP/1.1
-            if (strcmp(httpVersion, "HTTP/1.0") != 0 && 
-                strcmp(httpVersion, "HTTP/1.1") != 0) {
-                statusCode = 501; // "Not Implemented"
-                sendStatusLine(clntSock, statusCode, area);
-                goto loop_end;
-            }
-            
-            // requestURI must begin with "/"
-            if (!requestURI || *requestURI != '/') {
-                statusCode = 400; // "Bad Request"
-                sendStatusLine(clntSock, statusCode, area);
-                goto loop_end;
-            }
+    // -c: bytes of shared file cache, 0 turns the cache off.
+    long cacheBudget = CACHE_BUDGET;
+    int opt;
+    const char *logFile = NULL; // -l: access log file instead of stderr
+    int minSpare = MIN_SPARE;       // -m
+    int maxSpare = MAX_SPARE;       // -M
+    int maxChildren = MAX_CHILDREN; // -n
+    long rateLimit = RATE_LIMIT;    // -R: 0 turns the rate limit off
+    long rateBurst = RATE_BURST;    // -B
+    while ((opt = getopt(argc, argv, "c:l:m:M:n:R:B:")) != -1) {
+        switch (opt) {
+        case 'R':
+            rateLimit = atol(optarg);
+            break;
+        case 'B':
+            rateBurst = atol(optarg);
+            break;
+        case 'm':
+            minSpare = atoi(optarg);
+            break;
+        case 'M':
+            maxSpare = atoi(optarg);
+            break;
+        case 'n':
+            maxChildren = atoi(optarg);
+            break;
+        case 'l':
+            logFile = optarg;
+            break;
+        case 'c':
+            cacheBudget = atol(optarg);
+            if (cacheBudget < 0)
+                argc = 0; // print usage below
+            break;
+        default:
+            argc = 0; // print usage below
+        }
+    }
 
-            // make sure that the requestURI does not contain "/../" and 
-            // does not end with "/..", which would be a big security hole!
-            int len = strlen(requestURI);
-            if (len >= 3) {
-                char *tail = requestURI + (len - 3);
-                if (strcmp(tail, "/..") == 0 || 
-                    strstr(requestURI, "/../") != NULL)
-                {
-                statusCode = 400; // "Bad Request"
-                sendStatusLine(clntSock, statusCode, area);
-                goto loop_end;
-                }
-            }
+    if (minSpare < 1 || maxSpare < minSpare || maxChildren < 1 || 
+            maxChildren > CHILD_SLOTS)
+        argc = 0; // print usage below
+    if (rateLimit < 0 || rateLimit > RATE_LEVEL_MASK || rateBurst < 1 || 
+            rateBurst > RATE_LEVEL_MASK / 1000)
+        argc = 0; // print usage below
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: %s [-c cache_bytes] [-l log_file] "
+                "[-m min_spare] [-M max_spare] [-n max_children] "
+                "[-R conns_per_sec] [-B burst] <server_port> <web_root>\n",  
+                argv[0]);
+        exit(1);
+    }
 
-            /*
-            * Now let's skip all headers.
-            */
-
-            while (1) {
-                if (fgets(line, sizeof(line), clntFp) == NULL) {
-                // socket closed prematurely - there isn't much we can do
-                statusCode = 400; // "Bad Request"
-                goto loop_end;
-                }
-                if (strcmp("\r\n", line) == 0 || strcmp("\n", line) == 0) {
-                // This marks the end of headers.  
-                // Break out of the while loop.
-                break;
-                }
-            }
+    unsigned short servPort = atoi(argv[optind]);
+    const char *webRoot = argv[optind + 1];
 
-            /*
-            * At this point, we have a well-formed HTTP GET request.
-            * Let's handle it.
-            */
+    int servSock = createServerSocket(servPort);
 
-            statusCode = handleFileRequest(webRoot, requestURI, clntSock, area);
+    unsigned long n[4];
+    char latency[STATS_PAGE_SIZE];
+    struct poolcount pc;
+    struct timespec tick = { MAINTENANCE_MSEC / 1000, 
+        MAINTENANCE_MSEC % 1000 * 1000000L };
+    pid_t pid;
+    int i;
 
-        loop_end:
+    key = 0;	// which means that we skip the send stat in parent process
 
-            /*
-            * Done with client request.
-            * Log it, close the client socket, and go back to accepting
-            * connection.
-            */
-            
-            fprintf(stderr, "%s (%d) \"%s %s %s\" %d %s\n",
-                inet_ntoa(clntAddr.sin_addr),
-                getpid(),
-                method,
-                requestURI,
-                httpVersion,
-                statusCode,
-                getReasonPhrase(statusCode));
+    if((area = mmap(0, sizeof(struct reqstat), PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0)) == MAP_FAILED)
+    die("mmap error");
+    rateInit(&area->limiter, rateLimit, rateBurst);
 
-                // close the client socket 
-                fclose(clntFp);
-                // exit(0);
-            }
-            /* parent */
-            // close the client socket
-            // fclose(clntFp);
-        }
-    // free(area);
-    // fprintf(stderr, "parent \n");
+    clockStart();
+    if (cacheBudget > 0)
+        cache = cacheCreate(cacheBudget);
 
-    }
-    //parent
-    if (sigaction(SIGUSR1, &act, &oact) < 0)
+    logInit(logFile);
+    responseInit();
+    scanInit();
+
+    struct sigaction act;
+    act.sa_handler = sig_int;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0; // SIGUSR1 cuts the nanosleep() below short
+    if (sigaction(SIGUSR1, &act, NULL) < 0)
         die("signal error");
 
-    // for(int j = 0; j < 4; j++){
-waitstart:
-    if((pid = waitpid(-1, NULL, 0)) < 0){
-        // die("waitpid error");
+    for (i = 0; i < START_CHILDREN && i < maxChildren; i++)
+        spawnChild(servSock, webRoot);
+
+    // parent: look after the pool, and print statistics on SIGUSR1
+    for (;;) {
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            if (cache)
+                cacheReclaim(cache, pid);
+            releaseStatSlot(area, pid);
+        }
+        maintainPool(servSock, webRoot, minSpare, maxSpare, maxChildren);
+
         if (key == 1){ //interrupt
-            // for(int j = 0; j < 4; j++){
-            //     if((pid = waitpid(-1, NULL, 0)) < 0)
-            //     die("waitpid error");
-            // }
-            semres = sem_wait(&(area->sem)); // check return value it is waiting the sem to be larger than 0
-            while(EINTR == semres){
-                fflush(stdout);
-                fprintf(stdout, "interrupted here");
-                semres = sem_wait(&(area->sem));
-            }
+            sumStatistics(area, n);
+            countChildren(area, &pc);
             fprintf(stderr, "Request Statistics\n"
-                    "Number of 2XX : %d \n"
-                    "Number of 3XX : %d \n"
-                    "Number of 4XX : %d \n"
-                    "Number of 5XX : %d \n"
-                    "Sum : %d \n",
-                    area->num_two, area->num_three, area->num_four, area->num_five, area->num_two + area->num_three + area->num_four + area->num_five);
-                sem_post(&(area->sem));
+                    "Number of 2XX : %lu \n"
+                    "Number of 3XX : %lu \n"
+                    "Number of 4XX : %lu \n"
+                    "Number of 5XX : %lu \n"
+                    "Sum : %lu \n"
+                    "Children : %d (%d idle, %d busy)\n"
+                    "Rate limited : %lu (%lu untracked)\n",
+                    n[0], n[1], n[2], n[3], n[0] + n[1] + n[2] + n[3], 
+                    pc.total, pc.idle, pc.busy, 
+                    area->limiter.limited, area->limiter.untracked);
+            latency[0] = '\0';
+            formatLatency(latency, sizeof(latency), area, "");
+            fprintf(stderr, "%s", latency);
             key = 0;
-            goto waitstart;
         }
+        nanosleep(&tick, NULL);
     }
-    else{
-        goto forkhere;
-    }
-     //all end then end
-    munmap(area, sizeof(*area));
-    return 0;
 }
-
-
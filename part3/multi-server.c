@@ -262,7 +262,6 @@ static int handleFileRequest(
 
     char statistics[11] = "/statistics";
     int semres;
-    file = (char *)malloc(strlen(webRoot) + strlen(requestURI) + 100);
     if(strcmp(statistics, requestURI) == 0){ // send statistics
         statusCode = 200;
         semres = sem_wait(&(area->sem)); 
@@ -2,6 +2,8 @@
  * multi-server.c
  */
 
+#define _GNU_SOURCE     /* for accept4() and splice() */
+
 #include <stdio.h>      /* for printf() and fprintf() */
 #include <sys/socket.h> /* for socket(), bind(), and connect() */
 #include <arpa/inet.h>  /* for sockaddr_in and inet_ntoa() */
@@ -12,14 +14,65 @@
 #include <netdb.h>      /* for gethostbyname() */
 #include <signal.h>     /* for signal() */
 #include <sys/stat.h>   /* for stat() */
+#include <sys/sendfile.h> /* for sendfile() */
+#include <netinet/tcp.h>  /* for TCP_CORK */
 #include <pthread.h>    /* for pthread_create */
+#include <stdarg.h>     /* for va_list */
+#include <sys/uio.h>    /* for writev() */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  /* for the SSE2, SSE4.2 and AVX2 intrinsics */
+#define HAVE_X86_SIMD 1
+#endif
 #include <errno.h>
+#include <fcntl.h>      /* for fcntl() and open() */
+#include <sys/epoll.h>  /* for epoll_create1() and epoll_wait() */
+#include <sys/mman.h>   /* for mmap */
+#include <sys/syscall.h>  /* for syscall() */
+#include <linux/io_uring.h> /* for io_uring_setup() and io_uring_enter() */
+#include <linux/futex.h> /* for FUTEX_WAIT and FUTEX_WAKE */
 
-#define MAXPENDING 5    /* Maximum outstanding connection requests */
+#define MAXPENDING 128  /* default listen() backlog (-b) */
 
 #define DISK_IO_BUF_SIZE 4096
 
-#define N_THREADS 16
+#define SPLICE_PIPE_SIZE 65536 /* bytes moved per splice() through the pipe */
+
+#define REQ_BUF_SIZE 8192   /* longest request line plus headers we take */
+#define REQ_MAX_HEADERS 32  /* most header lines in one request */
+
+#define LOG_RING_SIZE 65536 /* access log bytes a worker can buffer, power of 2 */
+#define LOG_MAX_RINGS 256   /* threads per process that can log */
+#define LOG_LINE_MAX 512    /* longest access log line */
+#define LOG_FLUSH_MS 20     /* how often the logger writes the rings out */
+
+#define N_THREADS 16        /* workers at startup, all of them with -e/-u */
+#define MIN_THREADS 4       /* default fewest pool workers (-m) */
+#define MAX_THREADS 128     /* most pool workers, the largest -n */
+#define GROW_QUEUE_DEPTH 2  /* waiting connections that make the pool grow */
+#define GROW_WAIT_MS 20     /* queue wait that makes the pool grow */
+#define IDLE_RETIRE_SECS 30 /* idle time after which a worker may exit */
+#define MAX_QUEUED 512      /* default most waiting connections (-q) */
+#define QUEUE_WAIT_TARGET_MS 100 /* default queue wait we shed above (-w) */
+
+#define KEEPALIVE_TIMEOUT 5 /* seconds an idle persistent connection lives */
+#define HEADER_TIMEOUT 10   /* seconds a client has to send a request header */
+#define SEND_TIMEOUT 30     /* seconds a response may make no progress */
+#define SEND_CHUNK (1 << 20) /* bytes per sendfile(), between progress notes */
+#define TIMER_TICK_MS 100   /* resolution of the deadline timer wheels */
+
+#define FDCACHE_ENTRIES 32  /* open files kept by each worker thread */
+#define FDCACHE_URI_MAX 128 /* longest request URI kept open */
+#define FDCACHE_PATH_MAX 256 /* longest file path kept open */
+#define FDCACHE_TTL_SECS 1  /* how long an open file is trusted */
+
+#define QUEUE_CAPACITY 1024 /* connections waiting for a worker, power of 2 */
+
+enum server_mode {
+    MODE_THREADS, // select() acceptor feeding a blocking thread pool
+    MODE_EPOLL,   // -e: per-worker epoll event loops
+    MODE_URING,   // -u: per-worker io_uring event loops
+};
+
 static pthread_t thread_pool[N_THREADS];
 
 static void die(const char *message)
@@ -29,243 +82,2642 @@ static void die(const char *message)
 }
 
 /*
- * A message in a blocking queue
+ * Access log.
+ *
+ * All a worker does for a log line is format it into its own ring
+ * buffer.  A logger thread drains all the rings every LOG_FLUSH_MS with a
+ * single writev().  Every ring has one producer and one consumer, so
+ * head and tail only need atomic loads and stores.  When a ring is full
+ * the line is dropped and counted rather than making the worker wait.
+ *
+ * With -l the log goes to a file instead of stderr.  SIGHUP makes the
+ * loggers reopen the file, so it can be rotated by renaming it and then
+ * sending SIGHUP.
+ */
+struct logring {
+    unsigned long head;         // bytes written by the worker
+    int released;               // its thread has exited, free to take
+    char pad1[52];
+    unsigned long tail;         // bytes written out by the logger
+    char pad2[56];
+    char data[LOG_RING_SIZE];
+};
+
+// Shared by all processes, so that a SIGHUP to any of them is seen by all.
+struct logshared {
+    unsigned int generation;    // bumped by SIGHUP
+    unsigned long dropped;      // lines lost to full rings
+};
+
+static struct logring *logRings[LOG_MAX_RINGS];
+static int nLogRings;
+static __thread struct logring *myLogRing;
+static struct logshared *logShared;
+static const char *logPath;     // NULL means stderr
+static int logFd = STDERR_FILENO;
+
+static void sig_hup(int signo)
+{
+    __atomic_add_fetch(&logShared->generation, 1, __ATOMIC_RELAXED);
+}
+
+static int logOpen(void)
+{
+    int fd = open(logPath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        perror(logPath);
+    return fd;
+}
+
+/*
+ * Set up logging to path, or to stderr if path is NULL.  Called once
+ * before any worker (or child) starts.
+ */
+static void logInit(const char *path)
+{
+    logShared = mmap(0, sizeof(*logShared), PROT_READ | PROT_WRITE, 
+            MAP_ANON | MAP_SHARED, -1, 0);
+    if (logShared == MAP_FAILED)
+        die("mmap error");
+
+    logPath = path;
+    if (logPath != NULL && (logFd = logOpen()) < 0)
+        exit(1);
+
+    struct sigaction act;
+    act.sa_handler = sig_hup;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    if (sigaction(SIGHUP, &act, NULL) < 0)
+        die("sigaction failed");
+}
+
+// Give the calling thread a ring.  Returns NULL if there are none left.
+static struct logring *logRegister(void)
+{
+    int i, n = __atomic_load_n(&nLogRings, __ATOMIC_ACQUIRE);
+
+    // take over the ring of a thread that has exited, if there is one
+    for (i = 0; i < n && i < LOG_MAX_RINGS; i++) {
+        struct logring *r = __atomic_load_n(&logRings[i], __ATOMIC_ACQUIRE);
+        int released = 1;
+        if (r != NULL && __atomic_compare_exchange_n(&r->released, 
+                    &released, 0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return myLogRing = r;
+    }
+
+    i = n;
+    do {
+        if (i >= LOG_MAX_RINGS)
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&nLogRings, &i, i + 1, 0, 
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    struct logring *r = (struct logring *)malloc(sizeof(*r));
+    if (r == NULL)
+        die("malloc failed");
+    r->head = 0;
+    r->released = 0;
+    r->tail = 0;
+    __atomic_store_n(&logRings[i], r, __ATOMIC_RELEASE);
+    return myLogRing = r;
+}
+
+/*
+ * Queue one log line.  format should end with a newline.
+ */
+static void logPrintf(const char *format, ...)
+{
+    char line[LOG_LINE_MAX];
+    va_list ap;
+
+    va_start(ap, format);
+    int n = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if (n <= 0)
+        return;
+    if (n >= (int)sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+
+    struct logring *r = myLogRing ? myLogRing : logRegister();
+    if (r == NULL) {
+        __atomic_add_fetch(&logShared->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    unsigned long head = r->head;
+    unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING_SIZE - (head - tail) < (unsigned long)n) {
+        __atomic_add_fetch(&logShared->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    size_t off = head & (LOG_RING_SIZE - 1);
+    size_t first = n < LOG_RING_SIZE - off ? n : LOG_RING_SIZE - off;
+    memcpy(r->data + off, line, first);
+    memcpy(r->data, line + first, n - first);
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+}
+
+/*
+ * writev() all of iov, however many calls it takes.  On an error the
+ * rest is lost; there is nowhere left to report it.
+ */
+static void logWriteAll(struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(logFd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void *logger(void *arg)
+{
+    struct iovec iov[2 * LOG_MAX_RINGS];
+    struct logring *rings[LOG_MAX_RINGS];
+    unsigned long heads[LOG_MAX_RINGS];
+    unsigned int generation = 
+        __atomic_load_n(&logShared->generation, __ATOMIC_RELAXED);
+    struct timespec interval = { 0, LOG_FLUSH_MS * 1000000L };
+    int i;
+
+    pthread_detach(pthread_self());
+    for (;;) {
+        nanosleep(&interval, NULL);
+
+        // reopen the log file if it was rotated
+        unsigned int g = 
+            __atomic_load_n(&logShared->generation, __ATOMIC_RELAXED);
+        if (g != generation && logPath != NULL) {
+            int fd = logOpen();
+            if (fd >= 0) {
+                dup2(fd, logFd);
+                close(fd);
+            }
+        }
+        generation = g;
+
+        // collect what every ring has, at most two pieces per ring
+        int nRings = __atomic_load_n(&nLogRings, __ATOMIC_RELAXED);
+        if (nRings > LOG_MAX_RINGS)
+            nRings = LOG_MAX_RINGS;
+        int cnt = 0;
+        for (i = 0; i < nRings; i++) {
+            struct logring *r = rings[i] = 
+                __atomic_load_n(&logRings[i], __ATOMIC_ACQUIRE);
+            if (r == NULL)
+                continue;
+            unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            size_t len = head - r->tail;
+            size_t off = r->tail & (LOG_RING_SIZE - 1);
+            size_t first = len < LOG_RING_SIZE - off ? len : 
+                LOG_RING_SIZE - off;
+            heads[i] = head;
+            if (len == 0)
+                continue;
+            iov[cnt].iov_base = r->data + off;
+            iov[cnt++].iov_len = first;
+            if (len > first) {
+                iov[cnt].iov_base = r->data;
+                iov[cnt++].iov_len = len - first;
+            }
+        }
+        if (cnt == 0)
+            continue;
+        logWriteAll(iov, cnt);
+
+        // hand the space back to the workers
+        for (i = 0; i < nRings; i++)
+            if (rings[i] != NULL)
+                __atomic_store_n(&rings[i]->tail, heads[i], __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * Start the logger thread of this process.  It blocks all signals, so
+ * that a signal meant for sigwait() or a handler in another thread is
+ * never delivered to it.
+ */
+static void logStart(void)
+{
+    sigset_t all, old;
+    pthread_t tid;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&tid, NULL, logger, NULL) != 0)
+        die("pthread_create failed");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Called by a thread that is about to exit.  The logger still writes out
+ * what is left in its ring, and the next new thread takes the ring over.
+ */
+static void logRelease(void)
+{
+    if (myLogRing != NULL)
+        __atomic_store_n(&myLogRing->released, 1, __ATOMIC_RELEASE);
+    myLogRing = NULL;
+}
+
+/*
+ * Clock service.
+ *
+ * A clock thread wakes up at every full second of the wall clock and
+ * publishes the time in a shared page: wall clock and monotonic seconds,
+ * and the Date header line for that second, already formatted.  The page
+ * is MAP_SHARED and the thread runs in the process that forks the
+ * children, so one thread keeps the time for every worker and child.
+ * Readers take no lock: the clock thread makes seq odd while it writes
+ * and even again when it is done, and a reader retries when seq was odd
+ * or changed under it.
+ */
+#define DATE_LINE_LEN 37    /* "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n" */
+#define DATE_LINE_MAX 40    /* room for a Date line and its NUL */
+
+struct clockpage {
+    unsigned int seq;
+    time_t wall;                // CLOCK_REALTIME seconds
+    time_t mono;                // CLOCK_MONOTONIC seconds
+    char dateLine[DATE_LINE_MAX];
+};
+
+static struct clockpage *clockPage;
+
+static char *format2(char *p, unsigned int v)
+{
+    p[0] = '0' + v / 10 % 10;
+    p[1] = '0' + v % 10;
+    return p + 2;
+}
+
+/*
+ * Format the Date header line for t, an RFC 7231 IMF-fixdate, into buf,
+ * which must hold DATE_LINE_MAX bytes.  We do the calendar arithmetic
+ * ourselves (Howard Hinnant's days-to-civil): gmtime_r() takes a glibc
+ * lock, and a child forked while the clock thread held it would never
+ * see it released.
+ */
+static void formatDateLine(char *buf, time_t t)
+{
+    static const char weekdays[] = "ThuFriSatSunMonTueWed"; // from 1970-01-01
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    unsigned long days = (unsigned long)t / 86400;
+    unsigned long secs = (unsigned long)t % 86400;
+    char *p = buf;
+
+    unsigned long z = days + 719468;
+    unsigned long era = z / 146097;
+    unsigned long doe = z - era * 146097;
+    unsigned long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned long mp = (5 * doy + 2) / 153;
+    unsigned int mday = doy - (153 * mp + 2) / 5 + 1;
+    unsigned int month = mp < 10 ? mp + 3 : mp - 9;
+    unsigned int year = yoe + era * 400 + (month <= 2);
+
+    memcpy(p, "Date: ", 6);
+    p += 6;
+    memcpy(p, weekdays + 3 * (days % 7), 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p = format2(p, mday);
+    *p++ = ' ';
+    memcpy(p, months + 3 * (month - 1), 3);
+    p += 3;
+    *p++ = ' ';
+    p = format2(p, year / 100);
+    p = format2(p, year);
+    *p++ = ' ';
+    p = format2(p, secs / 3600);
+    *p++ = ':';
+    p = format2(p, secs / 60 % 60);
+    *p++ = ':';
+    p = format2(p, secs % 60);
+    memcpy(p, " GMT\r\n", 7);
+}
+
+// Publish the current time.  Called by the clock thread only.
+static void clockUpdate(void)
+{
+    struct timespec wall, mono;
+    char line[DATE_LINE_MAX];
+    unsigned int seq = clockPage->seq;
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    formatDateLine(line, wall.tv_sec);
+
+    __atomic_store_n(&clockPage->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&clockPage->wall, wall.tv_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&clockPage->mono, mono.tv_sec, __ATOMIC_RELAXED);
+    memcpy(clockPage->dateLine, line, sizeof(line));
+    __atomic_store_n(&clockPage->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void *clockThread(void *arg)
+{
+    struct timespec next;
+
+    for (;;) {
+        // sleep until the next full second
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec++;
+        next.tv_nsec = 0;
+        while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL)
+                == EINTR)
+            ;
+        clockUpdate();
+    }
+    return NULL;
+}
+
+/*
+ * Set up the clock page and start the clock thread.  Called once from
+ * main() before any worker or child starts.  The thread blocks all
+ * signals, so that they still interrupt the main thread's system calls.
+ */
+static void clockStart(void)
+{
+    sigset_t all, old;
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    clockPage = mmap(0, sizeof(*clockPage), PROT_READ | PROT_WRITE,
+            MAP_ANON | MAP_SHARED, -1, 0);
+    if (clockPage == MAP_FAILED)
+        die("mmap error");
+    clockUpdate();
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, clockThread, NULL) != 0)
+        die("pthread_create failed");
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Monotonic seconds, for timeouts.  At most a second behind.
+static inline time_t clockSeconds(void)
+{
+    return __atomic_load_n(&clockPage->mono, __ATOMIC_RELAXED);
+}
+
+// Wall clock seconds.  At most a second behind.
+static inline time_t clockWallSeconds(void)
+{
+    return __atomic_load_n(&clockPage->wall, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy the Date header line of the current second into buf, which must
+ * hold DATE_LINE_MAX bytes.  The line is NUL-terminated; returns its
+ * length, DATE_LINE_LEN.
+ */
+static size_t clockDateLine(char *buf)
+{
+    unsigned int seq;
+
+    do {
+        seq = __atomic_load_n(&clockPage->seq, __ATOMIC_ACQUIRE);
+        memcpy(buf, clockPage->dateLine, DATE_LINE_MAX);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) ||
+            seq != __atomic_load_n(&clockPage->seq, __ATOMIC_RELAXED));
+    return DATE_LINE_LEN;
+}
+
+static volatile sig_atomic_t key;
+
+static void sig_usr1(int signo){		/* signal handler */
+	key = 1;
+}
+
+/*
+ * A slot in the ring buffer.
+ * seq tells producers and consumers whose turn it is to use the slot:
+ * it equals the enqueue position when the slot is free, and the
+ * enqueue position + 1 once a socket has been stored in it.
  */
-struct message {
+struct cell {
+    unsigned long seq;
     int sock; // Payload, in our case a new client connection
-    struct message *next; // Next message on the list
+    unsigned long queuedAt; // nowUsec() when it was put in
 };
 
+static unsigned long nowUsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
 /*
- * This structure implements a blocking queue.
+ * This structure implements a bounded blocking queue.
  * If a thread attempts to pop an item from an empty queue
- * it is blocked until another thread appends a new item.
+ * it is blocked until another thread appends a new item,
+ * and a thread pushing onto a full queue is blocked until
+ * a slot frees up.
+ *
+ * Producers and consumers claim slots with compare-and-swap on their
+ * own position counter (a multi-producer/multi-consumer ring), so there
+ * is no lock and nothing is allocated per item.  Threads that find
+ * nothing to do sleep on a futex, and the other side only makes the
+ * wake-up system call when somebody is actually sleeping.
  */
 struct queue {
-    pthread_mutex_t mutex; // mutex used to protect the queue
-    pthread_cond_t cond;   // condition variable for threads to sleep on
-    struct message *first; // first message in the queue
-    struct message *last;  // last message in the queue
-    unsigned int length;   // number of elements on the queue
+    struct cell *cells;      // QUEUE_CAPACITY slots
+    unsigned long mask;      // QUEUE_CAPACITY - 1
+    char pad0[64];
+    unsigned long enqueuePos; // next slot producers will fill
+    char pad1[64];
+    unsigned long dequeuePos; // next slot consumers will empty
+    char pad2[64];
+    int items;           // futex, bumped on every put
+    int itemWaiters;     // consumers sleeping on items
+    int slots;           // futex, bumped on every get
+    int slotWaiters;     // producers sleeping on slots
 };
 
+static void futex_wait(int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+// like futex_wait(), but give up after secs; returns 0 on a timeout
+static int futex_wait_timeout(int *addr, int val, time_t secs)
+{
+    struct timespec timeout = { secs, 0 };
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &timeout, 
+            NULL, 0) == 0 || errno != ETIMEDOUT;
+}
+
+static void futex_wake(int *addr, int n)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
 
 // initializes the members of struct queue
 void queue_init(struct queue *q){
-    if(pthread_mutex_init(&q->mutex, NULL) != 0)
-        die("mutex destruction failed"); 
-    if(pthread_cond_init(&q->cond, NULL) != 0)
-        die("cond destruction failed"); 
-    q->first = NULL; 
-    q->last = NULL; 
-    q->length = 0; 
+    unsigned long i;
+
+    q->cells = (struct cell *)malloc(sizeof(struct cell) * QUEUE_CAPACITY);
+    if (q->cells == NULL)
+        die("malloc failed");
+    for (i = 0; i < QUEUE_CAPACITY; i++)
+        q->cells[i].seq = i;
+    q->mask = QUEUE_CAPACITY - 1;
+    q->enqueuePos = 0;
+    q->dequeuePos = 0;
+    q->items = 0;
+    q->itemWaiters = 0;
+    q->slots = 0;
+    q->slotWaiters = 0;
 };
 
 // deallocate and destroy everything in the queue
 void queue_destroy(struct queue *q){
-    struct message *msg;
-
-    //lock
-    pthread_mutex_lock(&q->mutex);
-    while (q->length != 0){
-        msg = q->first;
-        q->first = q->first->next;
-        q->length--;
-        free(msg);
-    }
-    q->last = NULL;
-    pthread_mutex_unlock(&q->mutex);
-
-    if(pthread_mutex_destroy(&q->mutex) != 0)
-        die("mutex destroy failed"); 
-    if(pthread_cond_destroy(&q->cond) != 0)
-        die("cond initialization failed"); 
+    free(q->cells);
+    q->cells = NULL;
 };
 
+// try to append sock; returns 0 if the queue is full
+static int queue_try_put(struct queue *q, int sock){
+    struct cell *cell;
+    unsigned long pos = __atomic_load_n(&q->enqueuePos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            // the slot is free, try to claim it
+            if (__atomic_compare_exchange_n(&q->enqueuePos, &pos, pos + 1, 
+                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) {
+            return 0; // full
+        }
+        else {
+            pos = __atomic_load_n(&q->enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->sock = sock;
+    cell->queuedAt = nowUsec();
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// try to take a socket; returns -1 if the queue is empty.  If queuedAt
+// isn't NULL, it is set to the time the socket was put in.
+static int queue_try_get(struct queue *q, unsigned long *queuedAt){
+    struct cell *cell;
+    unsigned long pos = __atomic_load_n(&q->dequeuePos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)seq - (long)(pos + 1);
+        if (diff == 0) {
+            // the slot holds a socket, try to claim it
+            if (__atomic_compare_exchange_n(&q->dequeuePos, &pos, pos + 1, 
+                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) {
+            return -1; // empty
+        }
+        else {
+            pos = __atomic_load_n(&q->dequeuePos, __ATOMIC_RELAXED);
+        }
+    }
+    int sock = cell->sock;
+    if (queuedAt != NULL)
+        *queuedAt = cell->queuedAt;
+    // hand the slot back to producers for the next lap around the ring
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return sock;
+}
+
+// wake up a producer waiting for room after we took a socket
+static void queue_slot_freed(struct queue *q){
+    __atomic_add_fetch(&q->slots, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->slotWaiters, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(&q->slots, 1);
+}
+
 // put a message into the queue and wake up workers if necessary
 void queue_put(struct queue *q, int sock){
-    struct message *pmsg;
-    pmsg = (struct message *)malloc(sizeof(*pmsg));
-    if (pmsg == NULL)
-        die("malloc failed");
-    pmsg->sock = sock;
-    pmsg->next = NULL;
+    for (;;) {
+        if (queue_try_put(q, sock))
+            break;
 
-    //lock
-    pthread_mutex_lock(&q->mutex);
-    if (q->length==0)
-        q->first = pmsg; 
-    else 
-        q->last->next = pmsg; 
-    q->last = pmsg;
-    q->length ++;
-    pthread_mutex_unlock(&q->mutex);
+        // Full.  Sleep until a consumer frees a slot.  We re-check after
+        // announcing ourselves so that we can't miss the wake-up.
+        int seen = __atomic_load_n(&q->slots, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&q->slotWaiters, 1, __ATOMIC_SEQ_CST);
+        if (queue_try_put(q, sock)) {
+            __atomic_sub_fetch(&q->slotWaiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        futex_wait(&q->slots, seen);
+        __atomic_sub_fetch(&q->slotWaiters, 1, __ATOMIC_SEQ_CST);
+    }
 
     // how to wake up workers?
-    if(pthread_cond_signal(&q->cond)!=0)
-        die("pthread_cond_signal failed");
-
+    __atomic_add_fetch(&q->items, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->itemWaiters, __ATOMIC_SEQ_CST) > 0)
+        futex_wake(&q->items, 1);
 };
 
 // take a socket descriptor from the queue; block if necessary
 int queue_get(struct queue *q){
     int sock;
-    struct message *pmsg;
-
-    // lock
-    pthread_mutex_lock(&q->mutex);
-
-    // Is this block?
-    while(q->length == 0)
-        pthread_cond_wait(&q->cond, &q->mutex);
-    pmsg = q->first; 
-    sock = pmsg->sock; 
-    q->first = pmsg->next;
-    if (q->length == 1)
-        q->last = NULL;
-    q->length --;
-    pthread_mutex_unlock(&q->mutex);
-    free(pmsg);
+
+    for (;;) {
+        sock = queue_try_get(q, NULL);
+        if (sock >= 0)
+            break;
+
+        // Empty.  Sleep until a producer adds something.
+        int seen = __atomic_load_n(&q->items, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&q->itemWaiters, 1, __ATOMIC_SEQ_CST);
+        sock = queue_try_get(q, NULL);
+        if (sock >= 0) {
+            __atomic_sub_fetch(&q->itemWaiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        futex_wait(&q->items, seen);
+        __atomic_sub_fetch(&q->itemWaiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    queue_slot_freed(q);
     return sock; 
     
 };
 
+/*
+ * Work-stealing scheduler for the thread pool.
+ *
+ * Every worker has its own queue, so in the common case a worker only
+ * touches its own cache lines.  The acceptor hands out connections round
+ * robin, and a worker whose queue is empty steals from its neighbours
+ * before going to sleep.  Each worker sleeps on its own futex.  A new
+ * connection wakes the worker it was queued for if that one is asleep,
+ * otherwise any sleeping worker, which will then steal it.
+ *
+ * The pool is elastic.  When no worker is asleep to take a new
+ * connection and GROW_QUEUE_DEPTH are already waiting in the queues, or a
+ * worker took a connection that had waited longer than GROW_WAIT_MS, the
+ * acceptor starts another worker, up to maxWorkers.  A worker that has
+ * slept for IDLE_RETIRE_SECS exits, as long as more than minWorkers are
+ * left.  Its slot then takes no new connections; if one got queued there
+ * anyway while it was leaving, the others steal it as from any queue.
+ *
+ * The acceptor also asks sched_admit() before it queues a connection.
+ * Once maxQueued connections are waiting, or a backlog has built up and
+ * the last connection a worker took had waited longer than waitTarget,
+ * a new connection would only wait to time out, so the acceptor answers
+ * it with a 503 right away instead.  The queue wait of the connections
+ * we do admit stays bounded that way.  Like CoDel, we look at how long
+ * connections actually waited rather than how many there are, and we
+ * admit again as soon as the queues are empty.
+ */
+enum worker_state {
+    WORKER_FREE,  // no thread, the acceptor may start one here
+    WORKER_LIVE,  // a thread serves this slot's queue
+};
+
+struct scheduler {
+    struct queue *queues; // one per worker slot
+    int maxWorkers;       // slots allocated
+    int minWorkers;       // never retire below this
+    int nSlots;           // slots ever used; we steal from all of them
+    int nLive;            // workers running now
+    unsigned int next;    // next queue the acceptor puts into
+    int growWanted;       // a worker saw a connection wait too long
+    unsigned long started; // workers started by the acceptor
+    unsigned long retired; // workers that exited when idle
+    unsigned long maxQueued;  // shed when this many are waiting
+    unsigned long waitTarget; // shed when connections wait longer, in usec
+    unsigned long lastWait;   // queue wait of the last connection taken
+    unsigned long shedFull;   // 503s because too many were waiting
+    unsigned long shedSlow;   // 503s because they waited too long
+    struct worker_stat {
+        unsigned long served; // connections this worker took
+        unsigned long stolen; // of which were taken from another queue
+        int wake;             // futex the worker sleeps on
+        int sleeping;         // set while the worker is (about to be) asleep
+        int state;            // enum worker_state
+        char pad[36];         // keep each worker on its own cache line
+    } *stats;
+};
+
+void sched_init(struct scheduler *s, int minWorkers, int maxWorkers, 
+        unsigned long maxQueued, unsigned long waitTarget){
+    int i;
+
+    s->queues = (struct queue *)malloc(sizeof(struct queue) * maxWorkers);
+    s->stats = (struct worker_stat *)calloc(maxWorkers, sizeof(*s->stats));
+    if (s->queues == NULL || s->stats == NULL)
+        die("malloc failed");
+    for (i = 0; i < maxWorkers; i++)
+        queue_init(&s->queues[i]);
+    s->maxWorkers = maxWorkers;
+    s->minWorkers = minWorkers;
+    s->nSlots = 0;
+    s->nLive = 0;
+    s->next = 0;
+    s->growWanted = 0;
+    s->started = 0;
+    s->retired = 0;
+    s->maxQueued = maxQueued;
+    s->waitTarget = waitTarget;
+    s->lastWait = 0;
+    s->shedFull = 0;
+    s->shedSlow = 0;
+}
+
+void sched_destroy(struct scheduler *s){
+    int i;
+
+    for (i = 0; i < s->maxWorkers; i++)
+        queue_destroy(&s->queues[i]);
+    free(s->queues);
+    free(s->stats);
+}
+
+// number of connections waiting in worker id's queue
+unsigned long sched_depth(struct scheduler *s, int id){
+    struct queue *q = &s->queues[id];
+    unsigned long enq = __atomic_load_n(&q->enqueuePos, __ATOMIC_RELAXED);
+    unsigned long deq = __atomic_load_n(&q->dequeuePos, __ATOMIC_RELAXED);
+    return enq > deq ? enq - deq : 0;
+}
+
+// connections waiting in all queues, counting no further than limit
+static unsigned long sched_waiting(struct scheduler *s, unsigned long limit){
+    unsigned long waiting = 0;
+    int i;
 
+    for (i = 0; i < s->nSlots && waiting < limit; i++)
+        waiting += sched_depth(s, i);
+    return waiting;
+}
 
+static int sched_live(struct scheduler *s, int id){
+    return __atomic_load_n(&s->stats[id].state, __ATOMIC_ACQUIRE) ==
+        WORKER_LIVE;
+}
 
 /*
- * Create a listening socket bound to the given port.
+ * Claim a free slot for a new worker; called by the acceptor only.
+ * Returns the slot, or -1 if the pool is at maxWorkers.
  */
-static int createServerSocket(unsigned short port)
-{
-    int servSock;
-    struct sockaddr_in servAddr;
+int sched_add_worker(struct scheduler *s){
+    int id;
 
-    /* Create socket for incoming connections */
-    if ((servSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-        die("socket() failed");
-      
-    /* Construct local address structure */
-    memset(&servAddr, 0, sizeof(servAddr));       /* Zero out structure */
-    servAddr.sin_family = AF_INET;                /* Internet address family */
-    servAddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
-    servAddr.sin_port = htons(port);              /* Local port */
+    if (__atomic_load_n(&s->nLive, __ATOMIC_RELAXED) >= s->maxWorkers)
+        return -1;
+    for (id = 0; id < s->maxWorkers; id++)
+        if (__atomic_load_n(&s->stats[id].state, __ATOMIC_ACQUIRE) ==
+                WORKER_FREE)
+            break;
+    if (id == s->maxWorkers)
+        return -1; // a retiring worker has not let go of its slot yet
+    __atomic_add_fetch(&s->nLive, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->stats[id].state, WORKER_LIVE, __ATOMIC_RELEASE);
+    if (id >= s->nSlots)
+        __atomic_store_n(&s->nSlots, id + 1, __ATOMIC_RELEASE);
+    s->started++;
+    return id;
+}
 
-    /* Bind to the local address */
-    if (bind(servSock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0)
-        die("bind() failed");
+// Undo sched_add_worker() when the thread could not be started.
+void sched_cancel_worker(struct scheduler *s, int id){
+    s->started--;
+    __atomic_store_n(&s->stats[id].state, WORKER_FREE, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&s->nLive, 1, __ATOMIC_RELAXED);
+}
 
-    /* Mark the socket so it will listen for incoming connections */
-    if (listen(servSock, MAXPENDING) < 0)
-        die("listen() failed");
+/*
+ * Hand a connection to the next worker; called by the acceptor only.
+ * Returns 1 if the pool should grow: nobody was asleep to take the
+ * connection and a backlog is building.
+ */
+int sched_put(struct scheduler *s, int sock){
+    int i, n = s->nSlots;
+    int first = s->next++ % n;
+
+    // if that worker's queue is full, try the others before blocking
+    for (i = 0; i < n; i++) {
+        int id = (first + i) % n;
+        if (sched_live(s, id) && queue_try_put(&s->queues[id], sock))
+            break;
+    }
+    if (i == n) {
+        while (!sched_live(s, first))
+            first = (first + 1) % n;
+        queue_put(&s->queues[first], sock);
+    }
+    else
+        first = (first + i) % n;
+
+    // wake the worker we queued for, or failing that anybody idle
+    for (i = 0; i < n; i++) {
+        struct worker_stat *w = &s->stats[(first + i) % n];
+        if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)) {
+            __atomic_add_fetch(&w->wake, 1, __ATOMIC_SEQ_CST);
+            futex_wake(&w->wake, 1);
+            return 0;
+        }
+    }
+    return sched_waiting(s, GROW_QUEUE_DEPTH) >= GROW_QUEUE_DEPTH ||
+        __atomic_exchange_n(&s->growWanted, 0, __ATOMIC_RELAXED);
+}
 
-    return servSock;
+/*
+ * Should the acceptor queue another connection?  Returns 0 if it should
+ * turn it away with a 503 instead; called by the acceptor only.
+ */
+int sched_admit(struct scheduler *s){
+    unsigned long waiting = sched_waiting(s, s->maxQueued);
+
+    if (waiting >= s->maxQueued) {
+        s->shedFull++;
+        return 0;
+    }
+    if (waiting > 0 && s->waitTarget > 0 && 
+            __atomic_load_n(&s->lastWait, __ATOMIC_RELAXED) > s->waitTarget) {
+        s->shedSlow++;
+        return 0;
+    }
+    return 1;
+}
+
+// take a connection from our own queue or steal one from a neighbour
+static int sched_try_get(struct scheduler *s, int id){
+    int i, sock;
+    int n = __atomic_load_n(&s->nSlots, __ATOMIC_ACQUIRE);
+    unsigned long queuedAt;
+
+    for (i = 0; i < n; i++) {
+        struct queue *q = &s->queues[(id + i) % n];
+        sock = queue_try_get(q, &queuedAt);
+        if (sock >= 0) {
+            queue_slot_freed(q);
+            s->stats[id].served++;
+            if (i > 0)
+                s->stats[id].stolen++;
+            unsigned long wait = nowUsec() - queuedAt;
+            __atomic_store_n(&s->lastWait, wait, __ATOMIC_RELAXED);
+            if (wait > GROW_WAIT_MS * 1000UL)
+                __atomic_store_n(&s->growWanted, 1, __ATOMIC_RELAXED);
+            return sock;
+        }
+    }
+    return -1;
+}
+
+// Give up our slot if that leaves at least minWorkers; returns 1 if so.
+static int sched_retire(struct scheduler *s, int id){
+    int n = __atomic_load_n(&s->nLive, __ATOMIC_RELAXED);
+
+    do {
+        if (n <= s->minWorkers)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&s->nLive, &n, n - 1, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&s->retired, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->stats[id].state, WORKER_FREE, __ATOMIC_RELEASE);
+    return 1;
 }
 
 /*
- * A wrapper around send() that does error checking and logging.
- * Returns -1 on failure.
- * 
- * This function assumes that buf is a null-terminated string, so
- * don't use this function to send binary data.
+ * Called by worker id; block until there is a connection for it.
+ * Returns -1 when the worker has been idle long enough to exit.
  */
-ssize_t Send(int sock, const char *buf)
-{
-    size_t len = strlen(buf);
-    ssize_t res = send(sock, buf, len, 0);
-    if (res != len) {
-        perror("send() failed");
-        return -1;
+int sched_get(struct scheduler *s, int id){
+    int sock, idle = 0;
+
+    for (;;) {
+        sock = sched_try_get(s, id);
+        if (sock >= 0)
+            return sock;
+        if (idle && sched_retire(s, id))
+            return -1;
+
+        // Nothing anywhere.  Same sleep protocol as queue_get().
+        struct worker_stat *w = &s->stats[id];
+        int seen = __atomic_load_n(&w->wake, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+        sock = sched_try_get(s, id);
+        if (sock >= 0) {
+            __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+            return sock;
+        }
+        idle = !futex_wait_timeout(&w->wake, seen, IDLE_RETIRE_SECS);
+        __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
     }
-    else 
-        return res;
 }
 
+
+
+
 /*
- * HTTP/1.0 status codes and the corresponding reason phrases.
+ * Connection deadlines.
+ *
+ * Whatever a connection is doing has a deadline: the client has
+ * HEADER_TIMEOUT to send the whole request header, may sit idle for
+ * KEEPALIVE_TIMEOUT between keep-alive requests, and has to keep taking
+ * our response, with no SEND_TIMEOUT stretch without progress.  A
+ * connection that misses its deadline is closed and counted, so a client
+ * that trickles in its headers (Slowloris) costs a timer, not a worker.
+ *
+ * The deadlines sit in a hierarchical timing wheel.  Level l has
+ * TIMER_SLOTS lists, one per 64^l ticks of TIMER_TICK_MS, and a timer
+ * goes into the lowest level that reaches its expiry time, so arming and
+ * cancelling one are O(1).  Every time the level 0 wheel wraps around,
+ * the timers in the current slot of level 1 are spread out over level 0,
+ * and so on up.  The event loops each have their own wheel; the thread
+ * pool shares one, advanced by a timer thread.
  */
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4      /* 64^4 ticks of 100 ms, about 19 days */
+
+enum deadline_kind {
+    DEADLINE_HEADER,    // reading the request line and headers
+    DEADLINE_KEEPALIVE, // waiting for the next request
+    DEADLINE_SEND,      // sending the response
+    N_DEADLINES
+};
 
-static struct {
-    int status;
-    char *reason;
-} HTTP_StatusCodes[] = {
-    { 200, "OK" },
-    { 201, "Created" },
-    { 202, "Accepted" },
-    { 204, "No Content" },
-    { 301, "Moved Permanently" },
-    { 302, "Moved Temporarily" },
-    { 304, "Not Modified" },
-    { 400, "Bad Request" },
-    { 401, "Unauthorized" },
-    { 403, "Forbidden" },
-    { 404, "Not Found" },
-    { 500, "Internal Server Error" },
-    { 501, "Not Implemented" },
-    { 502, "Bad Gateway" },
-    { 503, "Service Unavailable" },
-    { 0, NULL } // marks the end of the list
+static const char *deadlineNames[N_DEADLINES] = {
+    "request header", "keep-alive idle", "response send"
+};
+
+// connections closed for missing each kind of deadline, in any mode
+static unsigned long deadlinesExpired[N_DEADLINES];
+
+struct timerwheel;
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;     // NULL while the timer is not armed
+    struct timerwheel *wheel; // the wheel it is armed in
+    unsigned long expires;    // in ticks
+    int kind;                 // enum deadline_kind
+    void *data;               // what expired, for the expiry function
+};
+
+struct timerwheel {
+    unsigned long now;        // ticks up to now have been expired
+    int count;                // timers armed
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+static unsigned long timerTicks(void)
+{
+    return nowUsec() / (TIMER_TICK_MS * 1000UL);
+}
+
+static void timerWheelInit(struct timerwheel *w)
+{
+    memset(w, 0, sizeof(*w));
+    w->now = timerTicks();
+}
+
+static void timerInit(struct timer *t, void *data)
+{
+    t->pprev = NULL;
+    t->data = data;
+}
+
+// Put t into the slot for t->expires.
+static void timerLink(struct timerwheel *w, struct timer *t)
+{
+    unsigned long delta = t->expires - w->now;
+    int level = 0;
+
+    while (level < TIMER_LEVELS - 1 &&
+            delta >= 1UL << (TIMER_LEVEL_BITS * (level + 1)))
+        level++;
+    struct timer **slot = &w->slots[level][(t->expires >>
+            (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+    t->next = *slot;
+    if (t->next != NULL)
+        t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void timerCancel(struct timer *t)
+{
+    if (t->pprev == NULL)
+        return;
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+    t->wheel->count--;
+}
+
+// Arm t, which is not armed, to expire at tick expires.
+static void timerAdd(struct timerwheel *w, struct timer *t,
+        unsigned long expires)
+{
+    unsigned long longest = (1UL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1;
+
+    if (expires <= w->now)
+        expires = w->now + 1;
+    if (expires - w->now > longest)
+        expires = w->now + longest;
+    t->expires = expires;
+    t->wheel = w;
+    timerLink(w, t);
+    w->count++;
+}
+
+// Arm t to expire secs from now, instead of whenever it was armed for.
+static void timerSet(struct timerwheel *w, struct timer *t, int kind,
+        int secs)
+{
+    timerCancel(t);
+    t->kind = kind;
+    timerAdd(w, t, timerTicks() + secs * 1000UL / TIMER_TICK_MS);
+}
+
+/*
+ * Move the timers of level's current slot down to the levels below.
+ * Returns 1 if the level has wrapped around too, so the level above
+ * has to be moved down as well.
+ */
+static int timerCascade(struct timerwheel *w, int level)
+{
+    int index = (w->now >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1);
+    struct timer *t = w->slots[level][index];
+
+    w->slots[level][index] = NULL;
+    while (t != NULL) {
+        struct timer *next = t->next;
+        timerLink(w, t);
+        t = next;
+    }
+    return index == 0;
+}
+
+/*
+ * Expire every timer due by tick to, calling expire() for each one.
+ * The timer is no longer armed when expire() is called, so it may arm
+ * it again or free it.
+ */
+static void timerAdvance(struct timerwheel *w, unsigned long to,
+        void (*expire)(struct timer *t))
+{
+    while (w->now < to) {
+        if (w->count == 0) {
+            w->now = to; // nothing to expire, skip ahead
+            break;
+        }
+        w->now++;
+        int index = w->now & (TIMER_SLOTS - 1);
+        int level = 1;
+        if (index == 0)
+            while (level < TIMER_LEVELS && timerCascade(w, level))
+                level++;
+
+        while (w->slots[0][index] != NULL) {
+            struct timer *t = w->slots[0][index];
+            timerCancel(t);
+            expire(t);
+        }
+    }
+}
+
+// Count a connection closed because it missed a deadline of kind.
+static void deadlineMissed(int kind)
+{
+    __atomic_add_fetch(&deadlinesExpired[kind], 1, __ATOMIC_RELAXED);
+}
+
+static void printTimeoutStats(void)
+{
+    int i;
+
+    fprintf(stderr, "Timeouts :");
+    for (i = 0; i < N_DEADLINES; i++)
+        fprintf(stderr, "%s %lu %s", i > 0 ? "," : "",
+                __atomic_load_n(&deadlinesExpired[i], __ATOMIC_RELAXED),
+                deadlineNames[i]);
+    fprintf(stderr, "\n");
+}
+
+/*
+ * The thread pool's deadlines.
+ *
+ * A pool worker blocks in recv() and send(), so it cannot watch its own
+ * deadline.  The workers arm their timers in one shared wheel under
+ * poolTimersLock, and the timer thread expires them every TIMER_TICK_MS
+ * by shutting the socket down, which makes the worker's recv() or
+ * send() return.  The worker cancels its timer under the lock before it
+ * closes the socket, so we never shut down a descriptor that has been
+ * reused.  A body is sent in pieces and the worker notes the time after
+ * each one; an expired send deadline with recent progress is simply
+ * moved forward, so the send path never takes the lock.
+ */
+struct pool_deadline {
+    struct timer timer;
+    int sock;                 // the worker's connection
+    unsigned long progress;   // timerTicks() of the last bytes sent
+    int expired;              // the socket was shut down
+};
+
+static struct timerwheel poolTimers;
+static pthread_mutex_t poolTimersLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct pool_deadline *myDeadline;
+
+// Give the calling worker's connection a new deadline.
+static void poolDeadlineSet(int kind, int secs)
+{
+    struct pool_deadline *d = myDeadline;
+
+    __atomic_store_n(&d->progress, timerTicks(), __ATOMIC_RELAXED);
+    pthread_mutex_lock(&poolTimersLock);
+    timerSet(&poolTimers, &d->timer, kind, secs);
+    pthread_mutex_unlock(&poolTimersLock);
+}
+
+// Called before the worker closes its connection.
+static void poolDeadlineClear(void)
+{
+    pthread_mutex_lock(&poolTimersLock);
+    timerCancel(&myDeadline->timer);
+    pthread_mutex_unlock(&poolTimersLock);
+}
+
+// The response made progress; called from the send loops.
+static void poolDeadlineProgress(void)
+{
+    if (myDeadline != NULL)
+        __atomic_store_n(&myDeadline->progress, timerTicks(),
+                __ATOMIC_RELAXED);
+}
+
+// Did the calling worker's connection miss its deadline?
+static int poolDeadlineExpired(void)
+{
+    return __atomic_load_n(&myDeadline->expired, __ATOMIC_ACQUIRE);
+}
+
+static void poolDeadlineExpire(struct timer *t)
+{
+    struct pool_deadline *d = (struct pool_deadline *)t->data;
+    unsigned long progress =
+        __atomic_load_n(&d->progress, __ATOMIC_RELAXED);
+    unsigned long ticks = SEND_TIMEOUT * 1000UL / TIMER_TICK_MS;
+
+    if (t->kind == DEADLINE_SEND && progress + ticks > poolTimers.now) {
+        // it is still moving; that was not really a timeout
+        timerAdd(&poolTimers, t, progress + ticks);
+        return;
+    }
+    deadlineMissed(t->kind);
+    __atomic_store_n(&d->expired, 1, __ATOMIC_RELEASE);
+    shutdown(d->sock, SHUT_RDWR);
+}
+
+static void *poolTimerThread(void *arg)
+{
+    struct timespec tick = { 0, TIMER_TICK_MS * 1000000L };
+
+    for (;;) {
+        nanosleep(&tick, NULL);
+        pthread_mutex_lock(&poolTimersLock);
+        timerAdvance(&poolTimers, timerTicks(), poolDeadlineExpire);
+        pthread_mutex_unlock(&poolTimersLock);
+    }
+    return NULL;
+}
+
+// Start the timer thread of the thread pool, with all signals blocked.
+static void poolTimersStart(void)
+{
+    sigset_t all, old;
+    pthread_t tid;
+
+    timerWheelInit(&poolTimers);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&tid, NULL, poolTimerThread, NULL) != 0)
+        die("pthread_create failed");
+    pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Create a listening socket bound to the given port.
+ */
+static int createServerSocket(unsigned short port, int backlog)
+{
+    int servSock;
+    struct sockaddr_in servAddr;
+
+    /* Create socket for incoming connections */
+    if ((servSock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+        die("socket() failed");
+      
+    /* Construct local address structure */
+    memset(&servAddr, 0, sizeof(servAddr));       /* Zero out structure */
+    servAddr.sin_family = AF_INET;                /* Internet address family */
+    servAddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
+    servAddr.sin_port = htons(port);              /* Local port */
+
+    /* Bind to the local address */
+    if (bind(servSock, (struct sockaddr *)&servAddr, sizeof(servAddr)) < 0)
+        die("bind() failed");
+
+    /* Mark the socket so it will listen for incoming connections */
+    if (listen(servSock, backlog) < 0)
+        die("listen() failed");
+
+    return servSock;
+}
+
+/*
+ * A wrapper around send() that does error checking and logging.
+ * Returns -1 on failure.
+ * 
+ * This function assumes that buf is a null-terminated string, so
+ * don't use this function to send binary data.
+ */
+ssize_t Send(int sock, const char *buf)
+{
+    size_t len = strlen(buf);
+    ssize_t res = send(sock, buf, len, 0);
+    if (res != len) {
+        perror("send() failed");
+        return -1;
+    }
+    else 
+        return res;
+}
+
+/*
+ * Send everything in iov with writev(), however many calls it takes.
+ * iov is used up in the process.  Returns -1 on failure.
+ */
+static int sendIovec(int clntSock, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(clntSock, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("\nwritev() failed");
+            return -1;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * HTTP/1.0 status codes and the corresponding reason phrases.
+ */
+
+static struct {
+    int status;
+    char *reason;
+} HTTP_StatusCodes[] = {
+    { 200, "OK" },
+    { 201, "Created" },
+    { 202, "Accepted" },
+    { 204, "No Content" },
+    { 301, "Moved Permanently" },
+    { 302, "Moved Temporarily" },
+    { 304, "Not Modified" },
+    { 400, "Bad Request" },
+    { 401, "Unauthorized" },
+    { 403, "Forbidden" },
+    { 404, "Not Found" },
+    { 408, "Request Timeout" },
+    { 431, "Request Header Fields Too Large" },
+    { 500, "Internal Server Error" },
+    { 501, "Not Implemented" },
+    { 502, "Bad Gateway" },
+    { 503, "Service Unavailable" },
+    { 0, NULL } // marks the end of the list
+};
+
+/*
+ * Response templates.
+ *
+ * Everything in a response header that only depends on the status code
+ * is formatted once by responseInit() at startup: the status line and,
+ * for errors, the HTML body together with its Content-Length line.  The
+ * templates are indexed directly by status code, so building a response
+ * takes no lookups and no sprintf(); only the Date line (copied from the
+ * clock service) and the Content-Length of a 200 are patched in per
+ * request.
+ */
+#define STATUS_CODE_MAX 600
+#define RESPONSE_IOVECS 5   /* most pieces responseIovec() produces */
+#define LENGTH_LINE_MAX 40  /* longest Content-Length line */
+
+// The parts of a response that are formatted per request.
+struct response_lines {
+    char date[DATE_LINE_MAX];
+    char length[LENGTH_LINE_MAX];
+};
+
+struct response_template {
+    const char *reason;
+    char statusLine[64];        // "HTTP/1.1 404 Not Found\r\n"
+    size_t statusLineLen;
+    char lengthLine[LENGTH_LINE_MAX]; // Content-Length of body
+    size_t lengthLineLen;
+    char body[160];             // error page, empty for a 200
+    size_t bodyLen;
+};
+
+static struct response_template
+    responses[sizeof(HTTP_StatusCodes) / sizeof(HTTP_StatusCodes[0])];
+static struct response_template *responseByStatus[STATUS_CODE_MAX];
+
+// The header lines after Content-Length, with the blank line that ends
+// the headers.
+static const char connectionKeepAlive[] = "Connection: keep-alive\r\n\r\n";
+static const char connectionClose[] = "Connection: close\r\n\r\n";
+
+/*
+ * Format the Content-Length line for contentLength into buf, which must
+ * hold LENGTH_LINE_MAX bytes.  Returns its length.
+ */
+static size_t formatContentLength(char *buf, off_t contentLength)
+{
+    static const char name[] = "Content-Length: ";
+    char digits[24];
+    char *d = digits + sizeof(digits);
+    unsigned long long v = contentLength;
+
+    do {
+        *--d = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+
+    size_t n = digits + sizeof(digits) - d;
+    memcpy(buf, name, sizeof(name) - 1);
+    memcpy(buf + sizeof(name) - 1, d, n);
+    memcpy(buf + sizeof(name) - 1 + n, "\r\n", 2);
+    return sizeof(name) - 1 + n + 2;
+}
+
+/*
+ * Build the response templates.  Called once from main().
+ */
+static void responseInit(void)
+{
+    int i;
+
+    for (i = 0; HTTP_StatusCodes[i].status > 0; i++) {
+        struct response_template *t = &responses[i];
+        int status = HTTP_StatusCodes[i].status;
+
+        t->reason = HTTP_StatusCodes[i].reason;
+        t->statusLineLen = snprintf(t->statusLine, sizeof(t->statusLine),
+                "HTTP/1.1 %d %s\r\n", status, t->reason);
+
+        // For non-200 status, format the status line as an HTML content
+        // so that browers can display it.
+        if (status != 200) {
+            t->bodyLen = snprintf(t->body, sizeof(t->body),
+                    "<html><body>\n"
+                    "<h1>%d %s</h1>\n"
+                    "</body></html>\n",
+                    status, t->reason);
+            t->lengthLineLen = formatContentLength(t->lengthLine,
+                    t->bodyLen);
+        }
+        responseByStatus[status] = t;
+    }
+}
+
+/*
+ * The template for statusCode.  We only send the codes listed in
+ * HTTP_StatusCodes; anything else goes out as a 500.
+ */
+static inline const struct response_template *responseFor(int statusCode)
+{
+    if (statusCode > 0 && statusCode < STATUS_CODE_MAX &&
+            responseByStatus[statusCode] != NULL)
+        return responseByStatus[statusCode];
+    return responseByStatus[500];
+}
+
+static inline const char *getReasonPhrase(int statusCode)
+{
+    if (statusCode > 0 && statusCode < STATUS_CODE_MAX &&
+            responseByStatus[statusCode] != NULL)
+        return responseByStatus[statusCode]->reason;
+    return "Unknown Status Code";
+}
+
+/*
+ * Point iov at the status line and headers followed by a blank line,
+ * and for errors the HTML body.  Returns the number of iovecs used, at
+ * most RESPONSE_IOVECS.  The Date and Content-Length lines are formatted
+ * into lines, which must live as long as iov.
+ *
+ * contentLength is the size of a 200 body, or -1 if we don't know it.
+ * For other statuses the body and its length come from the template.
+ * keepAlive says whether we will read another request from the
+ * connection after this response.
+ */
+static int responseIovec(struct iovec *iov, struct response_lines *lines,
+        int statusCode, off_t contentLength, int keepAlive)
+{
+    const struct response_template *t = responseFor(statusCode);
+    int cnt = 0;
+
+    iov[cnt].iov_base = (void *)t->statusLine;
+    iov[cnt++].iov_len = t->statusLineLen;
+    iov[cnt].iov_base = lines->date;
+    iov[cnt++].iov_len = clockDateLine(lines->date);
+
+    // Content-Length frames the response so that the browser can send
+    // the next request on the same connection.
+    if (t->bodyLen > 0) {
+        iov[cnt].iov_base = (void *)t->lengthLine;
+        iov[cnt++].iov_len = t->lengthLineLen;
+    }
+    else if (contentLength >= 0) {
+        iov[cnt].iov_base = lines->length;
+        iov[cnt++].iov_len = formatContentLength(lines->length, 
+                contentLength);
+    }
+
+    if (keepAlive) {
+        iov[cnt].iov_base = (void *)connectionKeepAlive;
+        iov[cnt++].iov_len = sizeof(connectionKeepAlive) - 1;
+    }
+    else {
+        iov[cnt].iov_base = (void *)connectionClose;
+        iov[cnt++].iov_len = sizeof(connectionClose) - 1;
+    }
+
+    if (t->bodyLen > 0) {
+        iov[cnt].iov_base = (void *)t->body;
+        iov[cnt++].iov_len = t->bodyLen;
+    }
+    return cnt;
+}
+
+
+/*
+ * Format HTTP status line and headers followed by a blank line into buf,
+ * the same response that sendStatusLine() sends.  buf must be able to
+ * hold at least 1000 bytes.  Returns the length of the response.
+ */
+static size_t formatStatusLine(char *buf, int statusCode,
+        off_t contentLength, int keepAlive)
+{
+    struct iovec iov[RESPONSE_IOVECS];
+    struct response_lines lines;
+    size_t len = 0;
+    int i;
+
+    int cnt = responseIovec(iov, &lines, statusCode, contentLength,
+            keepAlive);
+    for (i = 0; i < cnt; i++) {
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/*
+ * Send HTTP status line and headers followed by a blank line, all with
+ * one writev().
+ */
+static void sendStatusLine(int clntSock, int statusCode,
+        off_t contentLength, int keepAlive)
+{
+    struct iovec iov[RESPONSE_IOVECS];
+    struct response_lines lines;
+
+    int cnt = responseIovec(iov, &lines, statusCode, contentLength,
+            keepAlive);
+    sendIovec(clntSock, iov, cnt);
+}
+
+/*
+ * Turn a connection away with a 503, from the acceptor, and close it.
+ * Nothing here may block: the response is a single non-blocking
+ * sendmsg() of the template, which fits in any socket buffer.  Whatever
+ * part of the request has arrived is read first, so that close() sends
+ * a FIN rather than a reset that could discard the 503 at the client.
+ */
+static void shedConnection(int clntSock)
+{
+    static char discard[REQ_BUF_SIZE];
+    struct iovec iov[RESPONSE_IOVECS];
+    struct response_lines lines;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = responseIovec(iov, &lines, 503, -1, 0);
+    recv(clntSock, discard, sizeof(discard), MSG_DONTWAIT);
+    sendmsg(clntSock, &msg, MSG_DONTWAIT);
+    shutdown(clntSock, SHUT_WR);
+    close(clntSock);
+}
+
+/*
+ * Request parsing.
+ *
+ * A request is parsed straight out of the connection's read buffer, and
+ * httpParse() is called again every time more bytes arrive.  Until the
+ * blank line that ends the headers shows up it only scans the new bytes
+ * for it.  Then it splits the request line and the headers in place:
+ * every token is NUL-terminated where its separator was, and the request
+ * gets pointers and lengths into the buffer.  Nothing is copied.
+ */
+struct strview {
+    char *p;        // NUL-terminated once the request is parsed
+    size_t len;
+};
+
+struct http_header {
+    struct strview name;
+    struct strview value;   // without surrounding blanks
+};
+
+struct http_request {
+    struct strview method;
+    struct strview uri;
+    struct strview version;
+    struct http_header headers[REQ_MAX_HEADERS];
+    int nHeaders;
+    unsigned short lineEnd[REQ_MAX_HEADERS + 1]; // offsets of the newlines
+    int nLines;
+    size_t scanned;     // bytes already searched for newlines
+    size_t length;      // request line and headers, once complete
+};
+
+#define PARSE_INCOMPLETE (-1) /* httpParse() needs more bytes */
+#define PARSE_EOF (-2)        /* readRequest(): closed before a request */
+
+static void httpRequestInit(struct http_request *req)
+{
+    req->method.p = req->uri.p = req->version.p = "";
+    req->method.len = req->uri.len = req->version.len = 0;
+    req->nHeaders = 0;
+    req->nLines = 0;
+    req->scanned = 0;
+    req->length = 0;
+}
+
+/*
+ * Delimiter scanning.
+ *
+ * The parser spends its time looking for newlines (to find the lines and
+ * the blank line that ends the headers) and for blanks and colons (to
+ * split a line).  Both are done 16 or 32 bytes at a time with SSE2/AVX2
+ * compares and SSE4.2 PCMPESTRI when the CPU has them; scanInit() picks
+ * the versions once at startup.  The scalar versions are the fallback
+ * and are what runs on other architectures.
+ */
+
+/*
+ * Note the newline at buf[i].  It ends the request line or a header
+ * line, or the headers if the line is blank.  Returns the length of the
+ * header block when buf[i] ends it, 0 otherwise, and -1 if req has no
+ * room for another line.  Whether a line is blank only depends on bytes
+ * before the newline, so a newline never has to be looked at twice.
+ */
+static inline long noteLineEnd(struct http_request *req, const char *buf,
+        size_t i)
+{
+    size_t start = req->nLines ? req->lineEnd[req->nLines - 1] + 1u : 0;
+
+    if (i == start || (i == start + 1 && buf[start] == '\r'))
+        return i + 1;
+    if (req->nLines == REQ_MAX_HEADERS + 1)
+        return -1;
+    req->lineEnd[req->nLines++] = i;
+    return 0;
+}
+
+/*
+ * Record the line ends in buf[req->scanned..len) and stop at the blank
+ * line.  Returns what noteLineEnd() returned for it, or 0 if the
+ * headers have not ended yet.
+ */
+static long scanLinesScalar(struct http_request *req, const char *buf,
+        size_t len)
+{
+    const char *p = buf + req->scanned;
+    const char *end = buf + len;
+    long r;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        if ((r = noteLineEnd(req, buf, p - buf)) != 0)
+            return r;
+        p++;
+    }
+    req->scanned = len;
+    return 0;
+}
+
+// The first byte of p[0..end) that is one of the n bytes of set, or end.
+static char *findCharScalar(char *p, char *end, const char *set, int n)
+{
+    for (; p < end; p++)
+        if (memchr(set, *p, n) != NULL)
+            return p;
+    return end;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static long scanLinesSse2(struct http_request *req, const char *buf,
+        size_t len)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = req->scanned;
+    long r;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        for (; mask != 0; mask &= mask - 1)
+            if ((r = noteLineEnd(req, buf, i + __builtin_ctz(mask))) != 0)
+                return r;
+    }
+    req->scanned = i;
+    return scanLinesScalar(req, buf, len);
+}
+
+__attribute__((target("avx2")))
+static long scanLinesAvx2(struct http_request *req, const char *buf,
+        size_t len)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = req->scanned;
+    long r;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        for (; mask != 0; mask &= mask - 1)
+            if ((r = noteLineEnd(req, buf, i + __builtin_ctz(mask))) != 0)
+                return r;
+    }
+    req->scanned = i;
+    return scanLinesScalar(req, buf, len);
+}
+
+// set holds at most 16 bytes.
+__attribute__((target("sse4.2")))
+static char *findCharSse42(char *p, char *end, const char *set, int n)
+{
+    char padded[16] = { 0 };
+    memcpy(padded, set, n);
+    const __m128i s = _mm_loadu_si128((const __m128i *)padded);
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int i = _mm_cmpestri(s, n, v, 16, _SIDD_UBYTE_OPS |
+                _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16)
+            return p + i;
+    }
+    return findCharScalar(p, end, set, n);
+}
+#endif
+
+static long (*scanLines)(struct http_request *req, const char *buf,
+        size_t len) = scanLinesScalar;
+static char *(*findChar)(char *p, char *end, const char *set, int n) =
+    findCharScalar;
+
+/*
+ * Pick the fastest scanners this CPU supports.  Called once from main()
+ * before any request is parsed.
+ */
+static void scanInit(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scanLines = scanLinesAvx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scanLines = scanLinesSse2;
+    if (__builtin_cpu_supports("sse4.2"))
+        findChar = findCharSse42;
+#endif
+}
+
+// Cut the next token off *s, which ends at end.
+static struct strview nextToken(char **s, char *end)
+{
+    struct strview v;
+    char *p = *s;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    v.p = p;
+    p = findChar(p, end, " \t", 2);
+    v.len = p - v.p;
+    *s = p;
+    return v;
+}
+
+/*
+ * Split the line buf[0..len) (without its line end) into the request
+ * line tokens of req.  Returns 0, or the HTTP status code to send.
+ */
+static int parseRequestLine(struct http_request *req, char *line,
+        size_t len)
+{
+    char *end = line + len;
+    char *p = line;
+
+    req->method = nextToken(&p, end);
+    req->uri = nextToken(&p, end);
+    req->version = nextToken(&p, end);
+    struct strview extraThingsOnRequestLine = nextToken(&p, end);
+
+    // check if we have 3 (and only 3) things in the request line
+    if (req->method.len == 0 || req->uri.len == 0 ||
+            req->version.len == 0 || extraThingsOnRequestLine.len != 0) {
+        req->method.p = req->uri.p = req->version.p = "";
+        return 501; // "Not Implemented"
+    }
+    req->method.p[req->method.len] = '\0';
+    req->uri.p[req->uri.len] = '\0';
+    req->version.p[req->version.len] = '\0';
+    return 0;
+}
+
+/*
+ * Split one header line buf[0..len) (without its line end) into name
+ * and value.  Returns 0, or the HTTP status code to send.
+ */
+static int parseHeader(struct http_request *req, char *line, size_t len)
+{
+    char *end = line + len;
+    char *colon = findChar(line, end, ":", 1);
+
+    // no whitespace is allowed between the name and the colon
+    if (colon == end || colon == line ||
+            colon[-1] == ' ' || colon[-1] == '\t')
+        return 400; // "Bad Request"
+
+    struct http_header *h = &req->headers[req->nHeaders++];
+    char *value = colon + 1;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    h->name.p = line;
+    h->name.len = colon - line;
+    h->value.p = value;
+    h->value.len = end - value;
+    *colon = '\0';
+    *end = '\0';
+    return 0;
+}
+
+/*
+ * Parse the request at the start of buf, of which len bytes have arrived
+ * so far.  req must have been set up with httpRequestInit() and passed
+ * in again, unchanged, together with the same buf when more bytes are
+ * in.  Returns 0 when the request is complete (req->length bytes of buf
+ * belong to it), PARSE_INCOMPLETE if the headers have not ended yet, or
+ * the HTTP status code to answer a broken request with.
+ */
+static int httpParse(struct http_request *req, char *buf, size_t len)
+{
+    long end = scanLines(req, buf, len);
+    if (end == 0)
+        return PARSE_INCOMPLETE;
+    if (end < 0)
+        return 431; // "Request Header Fields Too Large"
+    req->length = end;
+    if (req->nLines == 0)
+        return 501; // "Not Implemented"; no request line at all
+
+    size_t start = 0;
+    int i;
+    for (i = 0; i < req->nLines; i++) {
+        char *line = buf + start;
+        size_t n = req->lineEnd[i] - start;
+        if (n > 0 && line[n - 1] == '\r')
+            n--;
+        int status = i == 0 ? parseRequestLine(req, line, n) :
+            parseHeader(req, line, n);
+        if (status != 0)
+            return status;
+        start = req->lineEnd[i] + 1;
+    }
+    return 0;
+}
+
+/*
+ * The value of header name (case-insensitive) in req, or NULL if the
+ * request has no such header.
+ */
+static const char *httpHeader(const struct http_request *req,
+        const char *name)
+{
+    size_t len = strlen(name);
+    int i;
+
+    for (i = 0; i < req->nHeaders; i++)
+        if (req->headers[i].name.len == len &&
+                strcasecmp(req->headers[i].name.p, name) == 0)
+            return req->headers[i].value.p;
+    return NULL;
+}
+
+/*
+ * Does the client want the connection to stay open after this request?
+ * HTTP/1.1 connections are persistent by default, HTTP/1.0 connections
+ * only if the browser asks for it.
+ */
+static int httpKeepAlive(const struct http_request *req)
+{
+    const char *connection = httpHeader(req, "Connection");
+
+    if (connection != NULL) {
+        if (strcasestr(connection, "close"))
+            return 0;
+        if (strcasestr(connection, "keep-alive"))
+            return 1;
+    }
+    return strcmp(req->version.p, "HTTP/1.1") == 0;
+}
+
+/*
+ * Check that we can serve the parsed request.
+ * Returns 0 if the request line is acceptable, or the HTTP status code
+ * that should be sent to the browser otherwise.
+ */
+static int checkRequestLine(const struct http_request *req)
+{
+    // we only support GET method
+    if (strcmp(req->method.p, "GET") != 0)
+        return 501; // "Not Implemented"
+
+    // we only support HTTP/1.0 and HTTP/1.1
+    if (strcmp(req->version.p, "HTTP/1.0") != 0 &&
+        strcmp(req->version.p, "HTTP/1.1") != 0)
+        return 501; // "Not Implemented"
+
+    // requestURI must begin with "/"
+    if (req->uri.p[0] != '/')
+        return 400; // "Bad Request"
+
+    // make sure that the requestURI does not contain "/../" and
+    // does not end with "/..", which would be a big security hole!
+    if (req->uri.len >= 3) {
+        char *tail = req->uri.p + (req->uri.len - 3);
+        if (strcmp(tail, "/..") == 0 ||
+                strstr(req->uri.p, "/../") != NULL)
+            return 400; // "Bad Request"
+    }
+
+    return 0;
+}
+
+/*
+ * Read buffer of a blocking connection.  The current request is parsed
+ * in place; whatever was pipelined after it stays for the next one.
+ */
+struct reqbuf {
+    char data[REQ_BUF_SIZE];
+    size_t start;   // first byte of the current request
+    size_t next;    // first byte after it
+    size_t len;     // bytes in data
+};
+
+static void reqbufInit(struct reqbuf *rb)
+{
+    rb->start = rb->next = rb->len = 0;
+}
+
+/*
+ * Read and parse the next request on the blocking socket sock.
+ * Returns 0 when req holds it, PARSE_EOF if the connection was closed
+ * or timed out before the request began, or the HTTP status code to
+ * answer a broken request with.
+ */
+static int readRequest(int sock, struct reqbuf *rb, struct http_request *req)
+{
+    rb->start = rb->next;
+    if (rb->start == rb->len)
+        rb->start = rb->next = rb->len = 0;
+    httpRequestInit(req);
+
+    for (;;) {
+        if (rb->len > rb->start) {
+            int status = httpParse(req, rb->data + rb->start,
+                    rb->len - rb->start);
+            if (status != PARSE_INCOMPLETE) {
+                rb->next = status == 0 ? rb->start + req->length : rb->len;
+                return status;
+            }
+        }
+        if (rb->len == sizeof(rb->data)) {
+            if (rb->start == 0) {
+                rb->next = rb->len;
+                return 431; // "Request Header Fields Too Large"
+            }
+            // make room by moving the partial request to the front
+            memmove(rb->data, rb->data + rb->start, rb->len - rb->start);
+            rb->len -= rb->start;
+            rb->start = 0;
+        }
+        ssize_t n = recv(sock, rb->data + rb->len,
+                sizeof(rb->data) - rb->len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            rb->next = rb->len;
+            // socket closed prematurely - there isn't much we can do
+            return rb->len == rb->start ? PARSE_EOF : 400;
+        }
+        rb->len += n;
+
+        // The next request has begun; it has HEADER_TIMEOUT to arrive.
+        if (myDeadline != NULL && 
+                myDeadline->timer.kind == DEADLINE_KEEPALIVE)
+            poolDeadlineSet(DEADLINE_HEADER, HEADER_TIMEOUT);
+    }
+}
+
+/*
+ * Copy the file to the socket through a user space buffer.
+ * This is the slow path for files that sendfile() and splice() refuse.
+ * Returns -1 on failure.
+ */
+static int copyFileBody(int clntSock, int fd)
+{
+    ssize_t n;
+    char buf[DISK_IO_BUF_SIZE];
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (send(clntSock, buf, n, 0) != n) {
+            // send() failed.
+            // We log the failure, break out of the loop,
+            // and let the server continue on with the next request.
+            perror("\nsend() failed");
+            return -1;
+        }
+        poolDeadlineProgress();
+    }
+    if (n < 0) {
+        perror("read failed");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Move the file to the socket through a pipe with splice(), so the data
+ * never has to be copied into user space.  Used for anything that is not
+ * a regular file (sendfile() only reads from regular files).
+ * Returns -1 on failure.
+ */
+static int spliceFileBody(int clntSock, int fd)
+{
+    int pfd[2];
+    ssize_t n, m;
+
+    if (pipe(pfd) < 0) {
+        perror("pipe failed");
+        return copyFileBody(clntSock, fd);
+    }
+
+    for (;;) {
+        n = splice(fd, NULL, pfd[1], NULL, SPLICE_PIPE_SIZE, 
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0)
+            break;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(pfd[0]);
+            close(pfd[1]);
+            // the file does not support splice; copy it instead
+            if (errno == EINVAL)
+                return copyFileBody(clntSock, fd);
+            perror("splice failed");
+            return -1;
+        }
+        // drain the pipe into the socket
+        while (n > 0) {
+            m = splice(pfd[0], NULL, clntSock, NULL, n, 
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m <= 0) {
+                if (m < 0 && errno == EINTR)
+                    continue;
+                perror("\nsplice() to socket failed");
+                close(pfd[0]);
+                close(pfd[1]);
+                return -1;
+            }
+            n -= m;
+            poolDeadlineProgress();
+        }
+    }
+
+    close(pfd[0]);
+    close(pfd[1]);
+    return 0;
+}
+
+/*
+ * Send the body of an open file without copying it through user space:
+ * sendfile() for regular files, splice() for everything else.  A large
+ * file goes out SEND_CHUNK bytes per sendfile(), so that the send
+ * deadline sees the progress.  Returns -1 on failure.
+ */
+static int sendFileBody(int clntSock, int fd, const struct stat *st)
+{
+    if (!S_ISREG(st->st_mode))
+        return spliceFileBody(clntSock, fd);
+
+    // Pass our own offset: fd may be shared with the open file cache,
+    // so its file position is meaningless.
+    off_t offset = 0;
+    off_t remaining = st->st_size;
+    while (remaining > 0) {
+        ssize_t n = sendfile(clntSock, fd, &offset, 
+                remaining < SEND_CHUNK ? remaining : SEND_CHUNK);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // nothing sent yet and sendfile() is not supported here
+            if ((errno == EINVAL || errno == ENOSYS) && 
+                    remaining == st->st_size) {
+                lseek(fd, 0, SEEK_SET);
+                return spliceFileBody(clntSock, fd);
+            }
+            perror("\nsendfile() failed");
+            return -1;
+        }
+        if (n == 0) // file was truncated under us
+            break;
+        remaining -= n;
+        poolDeadlineProgress();
+    }
+    return 0;
+}
+
+/*
+ * Turn TCP_CORK on or off.  While the socket is corked the kernel only
+ * sends full segments, so the status line goes out in the same packet
+ * as the beginning of the file.
+ */
+static void setCork(int clntSock, int on)
+{
+    setsockopt(clntSock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/*
+ * Open file cache.
+ *
+ * Every worker thread keeps the last FDCACHE_ENTRIES regular files it
+ * served open, keyed by request URI, together with the composed path and
+ * the struct stat.  A repeated request then skips the malloc(), stat()
+ * and open() of the request path.  An entry is trusted for
+ * FDCACHE_TTL_SECS; after that its path is stat()ed again and the entry
+ * is dropped if the file was replaced or modified.
+ *
+ * The table is thread-local, so it needs no locking.  Bodies are sent
+ * with an explicit offset, so the shared file position of a cached
+ * descriptor never matters.
+ *
+ * An event loop thread sends many bodies at once, so a connection pins
+ * the entry it sends from (fdcachePin()) until it is closed.  A pinned
+ * entry is never replaced, and if its file changes it is only marked
+ * stale: no new request gets it, and its descriptor is closed when the
+ * last connection lets go of it.
+ */
+struct fdcache_entry {
+    int inUse;
+    int fd;
+    int refs;                  // connections still sending from fd
+    int stale;                 // dropped while pinned, close when unpinned
+    unsigned int hash;         // fdcacheHash() of uri
+    unsigned long lastUsed;    // for LRU replacement
+    time_t checked;            // clockSeconds() of the last revalidation
+    struct stat st;
+    char uri[FDCACHE_URI_MAX];
+    char path[FDCACHE_PATH_MAX];
+};
+
+static __thread struct fdcache_entry fdcache[FDCACHE_ENTRIES];
+static __thread unsigned long fdcacheClock;
+
+static unsigned int fdcacheHash(const char *s)
+{
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static void fdcacheDrop(struct fdcache_entry *e)
+{
+    if (e->refs > 0) {
+        e->stale = 1;
+        return;
+    }
+    close(e->fd);
+    e->inUse = 0;
+    e->stale = 0;
+}
+
+// Keep e and its descriptor for a connection until fdcacheUnpin().
+static void fdcachePin(struct fdcache_entry *e)
+{
+    e->refs++;
+}
+
+static void fdcacheUnpin(struct fdcache_entry *e)
+{
+    if (--e->refs == 0 && e->stale)
+        fdcacheDrop(e);
+}
+
+// Close every file this thread keeps open; called before it exits.
+static void fdcacheFlush(void)
+{
+    int i;
+
+    for (i = 0; i < FDCACHE_ENTRIES; i++)
+        if (fdcache[i].inUse)
+            fdcacheDrop(&fdcache[i]);
+}
+
+/*
+ * Find the open file for requestURI.  Returns NULL on a miss or if the
+ * cached file has changed on disk since it was opened.
+ */
+static struct fdcache_entry *fdcacheLookup(const char *requestURI)
+{
+    unsigned int hash = fdcacheHash(requestURI);
+    struct stat st;
+    int i;
+
+    for (i = 0; i < FDCACHE_ENTRIES; i++) {
+        struct fdcache_entry *e = &fdcache[i];
+        if (!e->inUse || e->stale || e->hash != hash || 
+                strcmp(e->uri, requestURI) != 0)
+            continue;
+
+        time_t now = clockSeconds();
+        if (now - e->checked >= FDCACHE_TTL_SECS) {
+            if (stat(e->path, &st) != 0 || 
+                    st.st_dev != e->st.st_dev || 
+                    st.st_ino != e->st.st_ino || 
+                    st.st_size != e->st.st_size || 
+                    st.st_mtim.tv_sec != e->st.st_mtim.tv_sec || 
+                    st.st_mtim.tv_nsec != e->st.st_mtim.tv_nsec) {
+                fdcacheDrop(e);
+                return NULL;
+            }
+            e->checked = now;
+        }
+        e->lastUsed = ++fdcacheClock;
+        return e;
+    }
+    return NULL;
+}
+
+/*
+ * Remember fd, opened from path for requestURI.  On success the cache
+ * owns fd and its entry is returned; otherwise the caller still has to
+ * close it.
+ */
+static struct fdcache_entry *fdcacheInsert(const char *requestURI, 
+        const char *path, int fd, const struct stat *st)
+{
+    struct fdcache_entry *victim = NULL;
+    int i;
+
+    if (strlen(requestURI) >= FDCACHE_URI_MAX || 
+            strlen(path) >= FDCACHE_PATH_MAX)
+        return NULL;
+
+    // take a free slot, or else the least recently used unpinned one
+    for (i = 0; i < FDCACHE_ENTRIES; i++) {
+        if (!fdcache[i].inUse) {
+            victim = &fdcache[i];
+            break;
+        }
+        if (fdcache[i].refs == 0 && 
+                (victim == NULL || fdcache[i].lastUsed < victim->lastUsed))
+            victim = &fdcache[i];
+    }
+    if (victim == NULL)
+        return NULL; // every entry is being sent from
+    if (victim->inUse)
+        fdcacheDrop(victim);
+
+    victim->inUse = 1;
+    victim->fd = fd;
+    victim->hash = fdcacheHash(requestURI);
+    victim->lastUsed = ++fdcacheClock;
+    victim->checked = clockSeconds();
+    victim->st = *st;
+    strcpy(victim->uri, requestURI);
+    strcpy(victim->path, path);
+    return victim;
+}
+
+/*
+ * Handle static file requests.
+ * Returns the HTTP status code that was sent to the browser.
+ * *keepAlive is cleared if the connection cannot be reused after this
+ * response.
+ */
+static int handleFileRequest(
+        const char *webRoot, const char *requestURI, int clntSock, 
+        int *keepAlive)
+{
+    int statusCode;
+    int fd = -1;
+    int fdCached = 0;
+    char *file = NULL;
+    struct stat st;
+
+    // A file this thread served recently is still open.
+    struct fdcache_entry *fe = fdcacheLookup(requestURI);
+    if (fe != NULL) {
+        fd = fe->fd;
+        fdCached = 1;
+        st = fe->st;
+        goto send_file;
+    }
+
+    // Compose the file path from webRoot and requestURI.
+    // If requestURI ends with '/', append "index.html".
+    
+    file = (char *)malloc(strlen(webRoot) + strlen(requestURI) + 100);
+    if (file == NULL)
+        die("malloc failed");
+    strcpy(file, webRoot);
+    strcat(file, requestURI);
+    if (file[strlen(file)-1] == '/') {
+        strcat(file, "index.html");
+    }
+
+    // See if the requested file is a directory.
+    // Our server does not support directory listing.
+
+    if (stat(file, &st) == 0 && S_ISDIR(st.st_mode)) {
+        statusCode = 403; // "Forbidden"
+        sendStatusLine(clntSock, statusCode, -1, *keepAlive);
+        goto func_end;
+    }
+
+    // If unable to open the file, send "404 Not Found".
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        statusCode = 404; // "Not Found"
+        sendStatusLine(clntSock, statusCode, -1, *keepAlive);
+        goto func_end;
+    }
+
+    // Keep regular files open for the next request to this thread.
+    if (S_ISREG(st.st_mode) && 
+            fdcacheInsert(requestURI, file, fd, &st) != NULL)
+        fdCached = 1;
+
+send_file:
+
+    // Otherwise, send "200 OK" followed by the file content.
+    // Cork the socket so that the status line and the beginning of the
+    // body share a packet.
+
+    // We only know the length of regular files.  For anything else the
+    // end of the body is marked by closing the connection.
+
+    statusCode = 200; // "OK"
+    if (!S_ISREG(st.st_mode))
+        *keepAlive = 0;
+    setCork(clntSock, 1);
+    sendStatusLine(clntSock, statusCode, 
+            S_ISREG(st.st_mode) ? st.st_size : -1, *keepAlive);
+
+    // send the file 
+    if (sendFileBody(clntSock, fd, &st) < 0)
+        *keepAlive = 0;
+    setCork(clntSock, 0);
+
+func_end:
+
+    // clean up
+    free(file);
+    if (fd >= 0 && !fdCached)
+        close(fd);
+
+    return statusCode;
+}
+
+
+static void printWorkerStats(struct scheduler *sched)
+{
+    int i;
+
+    fprintf(stderr, "Worker Statistics\n");
+    fprintf(stderr, "Pool : %d workers (min %d, max %d), "
+            "%lu started, %lu retired\n", 
+            __atomic_load_n(&sched->nLive, __ATOMIC_RELAXED), 
+            sched->minWorkers, sched->maxWorkers, sched->started, 
+            __atomic_load_n(&sched->retired, __ATOMIC_RELAXED));
+    printTimeoutStats();
+    fprintf(stderr, "Shed : %lu queue full, %lu over %lu ms wait "
+            "(last wait %lu us)\n", 
+            sched->shedFull, sched->shedSlow, sched->waitTarget / 1000, 
+            __atomic_load_n(&sched->lastWait, __ATOMIC_RELAXED));
+    for (i = 0; i < sched->nSlots; i++)
+        fprintf(stderr, "Worker %2d : queued %lu served %lu stolen %lu%s\n", 
+                i, sched_depth(sched, i), sched->stats[i].served, 
+                sched->stats[i].stolen, 
+                sched_live(sched, i) ? "" : " (exited)");
+}
+
+struct args {
+    const char *webRoot;
+    struct scheduler *sched;
+    int id; // worker number, picks our queue in sched
+};
+
+/*
+ * Create a function to handle requests
+ * As there are more than one argument, arg should be an struct
+ */
+void * thr_worker(void *arg)
+{
+    pthread_detach(pthread_self());
+    struct reqbuf *rb;
+    struct http_request req;
+    int statusCode;
+    int clntSock; 
+    struct args *args;
+    struct sockaddr_in clntAddr;
+    const char *webRoot;
+    struct scheduler *sched; 
+    struct pool_deadline deadline;
+    args = (struct args *)arg;  
+    char* ntoabuf;
+    ntoabuf = malloc(sizeof(char) * 100);
+    rb = (struct reqbuf *)malloc(sizeof(*rb));
+    if (rb == NULL)
+        die("malloc failed");
+    // servSock = args->servSock;
+    webRoot = args->webRoot;
+    sched = args->sched;
+    timerInit(&deadline.timer, &deadline);
+    myDeadline = &deadline;
+
+    for(;;){
+
+        // There is a while loop in this function, it will wait until there is a socket comming 
+        clntSock = sched_get(sched, args->id); 
+
+        if (clntSock < 0)
+            break; // idle for too long, the pool shrinks 
+
+        // We should get client address from client socket
+        unsigned int clntLen = sizeof(clntAddr); 
+        if(getpeername(clntSock, (struct sockaddr *)&clntAddr, &clntLen) != 0)
+            die("getpeername failed");
+
+        // Don't let a slow or idle client hold this thread forever.
+        deadline.sock = clntSock;
+        __atomic_store_n(&deadline.expired, 0, __ATOMIC_RELAXED);
+
+        /*
+         * Serve requests on this connection until one of them asks us to
+         * close it.  Pipelined requests are already waiting in rb, so we
+         * simply handle them one after the other.
+         */
+        reqbufInit(rb);
+
+        int keepAlive;
+        int nRequests = 0;
+        do {
+
+        /*
+         * Let's read and parse the request line and headers.
+         */
+
+        keepAlive = 0;
+
+        // A pipelined request has already begun.
+        if (nRequests == 0 || rb->next < rb->len)
+            poolDeadlineSet(DEADLINE_HEADER, HEADER_TIMEOUT);
+        else
+            poolDeadlineSet(DEADLINE_KEEPALIVE, KEEPALIVE_TIMEOUT);
+
+        statusCode = readRequest(clntSock, rb, &req);
+        if (statusCode == PARSE_EOF) {
+            // The client closed an idle keep-alive connection or it
+            // timed out.  That's normal, nothing to log.
+            if (nRequests > 0)
+                break;
+            // socket closed - there isn't much we can do
+            statusCode = poolDeadlineExpired() ? 408 : 400;
+            goto loop_end;
+        }
+        nRequests++;
+        if (poolDeadlineExpired()) {
+            // the socket is shut down already, too late to answer
+            statusCode = 408; // "Request Timeout"
+            goto loop_end;
+        }
+        poolDeadlineSet(DEADLINE_SEND, SEND_TIMEOUT);
+
+        if (statusCode == 0)
+            statusCode = checkRequestLine(&req);
+        if (statusCode != 0) {
+            sendStatusLine(clntSock, statusCode, -1, 0);
+            goto loop_end;
+        }
+
+        keepAlive = httpKeepAlive(&req);
+
+        /*
+         * At this point, we have a well-formed HTTP GET request.
+         * Let's handle it.
+         */
+
+        statusCode = handleFileRequest(webRoot, req.uri.p, clntSock, 
+                &keepAlive);
+
+loop_end:
+
+        /*
+         * Done with client request.
+         * Log it, and go back to reading the next request on this
+         * connection if it is persistent.
+         */
+        
+        logPrintf("%s \"%s %s %s\" %d %s\n",
+                inet_ntop(AF_INET, &clntAddr.sin_addr, ntoabuf, 100),
+                req.method.p,
+                req.uri.p,
+                req.version.p,
+                statusCode,
+                getReasonPhrase(statusCode));
+
+        } while (keepAlive);
+
+        // close the client socket 
+        poolDeadlineClear();
+        close(clntSock);
+    } // for(;;)
+
+    myDeadline = NULL;
+    fdcacheFlush();
+    logRelease();
+    free(ntoabuf);
+    free(rb);
+    free(args);
+    return((void *)0);
+
+}
+
+/*
+ * Start a pool worker in a free slot of sched.  Returns 0 if the pool is
+ * already at its limit or no thread could be created.
+ */
+static int startWorker(struct scheduler *sched, const char *webRoot)
+{
+    struct args *args;
+    pthread_t tid;
+    int id = sched_add_worker(sched);
+
+    if (id < 0)
+        return 0;
+    args = (struct args *)malloc(sizeof(*args));
+    if (args == NULL)
+        die("malloc failed");
+    args->webRoot = webRoot; 
+    args->sched = sched; 
+    args->id = id;
+    if (pthread_create(&tid, NULL, thr_worker, args) != 0) {
+        // out of threads or memory: make do with the workers we have
+        sched_cancel_worker(sched, id);
+        free(args);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Event loop mode.
+ *
+ * Each worker thread runs its own epoll loop over all listening sockets
+ * and its own non-blocking client sockets.  A connection is a small
+ * state machine: we read until we have the whole request header, then
+ * send the status line and finally the file body, moving on to other
+ * connections whenever a socket would block.
+ */
+
+#define EPOLL_MAX_EVENTS 64
+
+enum conn_state {
+    CONN_LISTEN,      // a listening socket, not a client connection
+    CONN_READ,        // reading the request line and headers
+    CONN_SEND_HEADER, // sending the status line (and error body)
+    CONN_SEND_BODY,   // sending the file content
 };
 
-static inline const char *getReasonPhrase(int statusCode)
+struct conn {
+    enum conn_state state;
+    int sock;
+    struct sockaddr_in clntAddr;
+    char req[REQ_BUF_SIZE]; // request line and headers
+    size_t reqLen;
+    struct http_request parsed; // views into req
+    char out[DISK_IO_BUF_SIZE]; // pending outgoing bytes
+    size_t outLen;
+    size_t outSent;
+    int fileFd;
+    struct fdcache_entry *fileCached; // pinned entry that fileFd belongs to
+    off_t fileOff;  // next file offset to send
+    off_t fileLen;  // Content-Length of the body, -1 if it has none
+    int sendFile;  // regular file, send the body with sendfile()
+    int statusCode;
+    int multishot; // listeners only: multishot accept is armed (io_uring)
+    struct timer timer; // the deadline of what the connection is doing
+};
+
+static void setNonBlocking(int fd)
 {
-    int i = 0;
-    while (HTTP_StatusCodes[i].status > 0) {
-        if (HTTP_StatusCodes[i].status == statusCode)
-            return HTTP_StatusCodes[i].reason;
-        i++;
-    }
-    return "Unknown Status Code";
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        die("fcntl failed");
 }
 
-
 /*
- * Send HTTP status line followed by a blank line.
+ * Allocate the state for a newly accepted client connection.
  */
-static void sendStatusLine(int clntSock, int statusCode)
+static struct conn *connNew(int sock)
 {
-    char buf[1000];
-    const char *reasonPhrase = getReasonPhrase(statusCode);
-
-    // print the status line into the buffer
-    sprintf(buf, "HTTP/1.0 %d ", statusCode);
-    strcat(buf, reasonPhrase);
-    strcat(buf, "\r\n");
-
-    // We don't send any HTTP header in this simple server.
-    // We need to send a blank line to signal the end of headers.
-    strcat(buf, "\r\n");
+    struct conn *c = (struct conn *)malloc(sizeof(*c));
+    if (c == NULL)
+        die("malloc failed");
 
-    // For non-200 status, format the status line as an HTML content
-    // so that browers can display it.
-    if (statusCode != 200) {
-        char body[1000];
-        sprintf(body, 
-                "<html><body>\n"
-                "<h1>%d %s</h1>\n"
-                "</body></html>\n",
-                statusCode, reasonPhrase);
-        strcat(buf, body);
-    }
+    c->state = CONN_READ;
+    c->sock = sock;
+    c->reqLen = 0;
+    c->outLen = 0;
+    c->outSent = 0;
+    c->fileFd = -1;
+    c->fileCached = NULL;
+    c->fileOff = 0;
+    c->fileLen = -1;
+    c->sendFile = 0;
+    c->statusCode = 0;
+    httpRequestInit(&c->parsed);
+    timerInit(&c->timer, c);
+    return c;
+}
 
-    // send the buffer to the browser
-    Send(clntSock, buf);
+/*
+ * Log the request and release everything held by the connection.
+ * Closing the socket also removes it from any epoll set.
+ */
+static void connClose(struct conn *c)
+{
+    char ntoabuf[INET_ADDRSTRLEN];
+
+    logPrintf("%s \"%s %s %s\" %d %s\n",
+            inet_ntop(AF_INET, &c->clntAddr.sin_addr, ntoabuf, 
+                sizeof(ntoabuf)),
+            c->parsed.method.p,
+            c->parsed.uri.p,
+            c->parsed.version.p,
+            c->statusCode,
+            getReasonPhrase(c->statusCode));
+
+    timerCancel(&c->timer);
+    close(c->sock);
+    if (c->fileCached != NULL)
+        fdcacheUnpin(c->fileCached);
+    else if (c->fileFd >= 0)
+        close(c->fileFd);
+    free(c);
 }
 
 /*
- * Handle static file requests.
- * Returns the HTTP status code that was sent to the browser.
+ * We have the complete request header in c->req, and parseStatus is
+ * what httpParse() said about it.
+ * Decide on the response and queue the status line.
  */
-static int handleFileRequest(
-        const char *webRoot, const char *requestURI, int clntSock)
+static void connStartResponse(const char *webRoot, struct conn *c, 
+        int parseStatus)
 {
-    int statusCode;
-    FILE *fp = NULL;
+    char *file = NULL;
+    struct stat st;
+    off_t contentLength = -1;
+    const char *requestURI = c->parsed.uri.p;
 
-    // Compose the file path from webRoot and requestURI.
-    // If requestURI ends with '/', append "index.html".
-    
-    char *file = (char *)malloc(strlen(webRoot) + strlen(requestURI) + 100);
+    c->statusCode = parseStatus;
+    if (c->statusCode == 0)
+        c->statusCode = checkRequestLine(&c->parsed);
+    if (c->statusCode != 0)
+        goto func_end;
+
+    struct fdcache_entry *fe = fdcacheLookup(requestURI);
+    if (fe != NULL) {
+        fdcachePin(fe);
+        c->fileFd = fe->fd;
+        c->fileCached = fe;
+        st = fe->st;
+        goto found;
+    }
+
+    file = (char *)malloc(strlen(webRoot) + strlen(requestURI) + 100);
     if (file == NULL)
         die("malloc failed");
     strcpy(file, webRoot);
@@ -274,224 +2726,630 @@ static int handleFileRequest(
         strcat(file, "index.html");
     }
 
-    // See if the requested file is a directory.
-    // Our server does not support directory listing.
-
-    struct stat st;
     if (stat(file, &st) == 0 && S_ISDIR(st.st_mode)) {
-        statusCode = 403; // "Forbidden"
-        sendStatusLine(clntSock, statusCode);
+        c->statusCode = 403; // "Forbidden"
         goto func_end;
     }
 
-    // If unable to open the file, send "404 Not Found".
-
-    fp = fopen(file, "rb");
-    if (fp == NULL) {
-        statusCode = 404; // "Not Found"
-        sendStatusLine(clntSock, statusCode);
+    c->fileFd = open(file, O_RDONLY);
+    if (c->fileFd < 0 || fstat(c->fileFd, &st) != 0) {
+        c->statusCode = 404; // "Not Found"
         goto func_end;
     }
+    if (S_ISREG(st.st_mode) && (c->fileCached = 
+                fdcacheInsert(requestURI, file, c->fileFd, &st)) != NULL)
+        fdcachePin(c->fileCached);
+found:
+    c->statusCode = 200; // "OK"
+    c->sendFile = S_ISREG(st.st_mode);
+    if (c->sendFile)
+        contentLength = st.st_size;
+    c->fileLen = contentLength;
 
-    // Otherwise, send "200 OK" followed by the file content.
+func_end:
+    free(file);
+    // one request per connection in this mode
+    c->outLen = formatStatusLine(c->out, c->statusCode, contentLength, 0);
+    c->outSent = 0;
+    c->state = CONN_SEND_HEADER;
+}
 
-    statusCode = 200; // "OK"
-    sendStatusLine(clntSock, statusCode);
+/*
+ * Read as much of the request as is available.
+ * Returns -1 if the connection should be closed.
+ */
+static int connRead(const char *webRoot, struct conn *c)
+{
+    for (;;) {
+        if (c->reqLen == sizeof(c->req)) {
+            // headers too large for us
+            connStartResponse(webRoot, c, 431);
+            return 0;
+        }
+        ssize_t n = recv(c->sock, c->req + c->reqLen, 
+                sizeof(c->req) - c->reqLen, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            c->statusCode = 400; // "Bad Request"
+            return -1;
+        }
+        if (n == 0) {
+            // socket closed prematurely - there isn't much we can do
+            c->statusCode = 400; // "Bad Request"
+            return -1;
+        }
+        c->reqLen += n;
 
-    // send the file 
-    size_t n;
-    char buf[DISK_IO_BUF_SIZE];
-    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
-        if (send(clntSock, buf, n, 0) != n) {
-            // send() failed.
-            // We log the failure, break out of the loop,
-            // and let the server continue on with the next request.
+        int status = httpParse(&c->parsed, c->req, c->reqLen);
+        if (status != PARSE_INCOMPLETE) {
+            connStartResponse(webRoot, c, status);
+            return 0;
+        }
+    }
+}
+
+/*
+ * Send as much of the response as the socket will take.
+ * Returns 1 when the response is complete, 0 if the socket would block,
+ * and -1 on error.
+ */
+static int connWrite(struct conn *c)
+{
+    for (;;) {
+        if (c->outSent == c->outLen) {
+            if (c->state == CONN_SEND_HEADER) {
+                if (c->fileFd < 0)
+                    return 1;
+                c->state = CONN_SEND_BODY;
+            }
+            if (c->sendFile) {
+                // the kernel moves the bytes straight from the page cache
+                ssize_t n = sendfile(c->sock, c->fileFd, &c->fileOff, 
+                        SPLICE_PIPE_SIZE);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return 0;
+                    if (errno == EINTR)
+                        continue;
+                    perror("\nsendfile() failed");
+                    return -1;
+                }
+                if (n == 0) {
+                    if (c->fileOff < c->fileLen) {
+                        // the client would wait for the rest forever
+                        fprintf(stderr, "\nsendfile() ended early: "
+                                "file shrank\n");
+                        return -1;
+                    }
+                    return 1;
+                }
+                continue;
+            }
+            ssize_t n = read(c->fileFd, c->out, sizeof(c->out));
+            if (n < 0) {
+                perror("read failed");
+                return -1;
+            }
+            if (n == 0)
+                return 1;
+            c->outLen = n;
+            c->outSent = 0;
+        }
+
+        // Hold back the status line of a 200 until the body follows.
+        int flags = (c->state == CONN_SEND_HEADER && c->fileFd >= 0) ? 
+            MSG_MORE : 0;
+        ssize_t n = send(c->sock, c->out + c->outSent, 
+                c->outLen - c->outSent, flags);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
             perror("\nsend() failed");
-            break;
+            return -1;
         }
+        c->outSent += n;
     }
-    // fread() returns 0 both on EOF and on error.
-    // Let's check if there was an error.
-    if (ferror(fp))
-        perror("fread failed");
+}
 
-func_end:
+static void connAccept(int epfd, int servSock, struct timerwheel *timers)
+{
+    struct epoll_event ev;
 
-    // clean up
-    free(file);
-    if (fp)
-        fclose(fp);
+    struct sockaddr_in clntAddr;
 
-    return statusCode;
-}
+    for (;;) {
+        unsigned int clntLen = sizeof(clntAddr);
+        int clntSock = accept4(servSock, (struct sockaddr *)&clntAddr, 
+                &clntLen, SOCK_NONBLOCK);
+        if (clntSock < 0) {
+            // Another worker may have taken the connection.
+            if (errno == EAGAIN || errno == EWOULDBLOCK || 
+                    errno == EINTR || errno == ECONNABORTED)
+                return;
+            die("accept() failed");
+        }
 
+        struct conn *c = connNew(clntSock);
+        c->clntAddr = clntAddr;
+        timerSet(timers, &c->timer, DEADLINE_HEADER, HEADER_TIMEOUT);
 
-struct args {
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->sock, &ev) < 0)
+            die("epoll_ctl failed");
+    }
+}
+
+struct epoll_args {
     const char *webRoot;
-    struct queue *q ;
+    int *servSocks;
+    int nServSocks;
+};
+
+// A connection missed its deadline; an event loop closes it right away.
+static void connExpire(struct timer *t)
+{
+    struct conn *c = (struct conn *)t->data;
+
+    deadlineMissed(t->kind);
+    if (t->kind == DEADLINE_HEADER)
+        c->statusCode = 408; // "Request Timeout"
+    connClose(c);
+}
+
+void * epoll_worker(void *arg)
+{
+    struct epoll_args *args = (struct epoll_args *)arg;
+    struct epoll_event ev;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    struct timerwheel timers;
+    int i, n;
+
+    timerWheelInit(&timers);
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0)
+        die("epoll_create1 failed");
+
+    // Every worker watches every listening socket.  EPOLLEXCLUSIVE
+    // keeps a new connection from waking up all of them.
+    for (i = 0; i < args->nServSocks; i++) {
+        struct conn *l = (struct conn *)malloc(sizeof(*l));
+        if (l == NULL)
+            die("malloc failed");
+        l->state = CONN_LISTEN;
+        l->sock = args->servSocks[i];
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = l;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, l->sock, &ev) < 0)
+            die("epoll_ctl failed");
+    }
+
+    for (;;) {
+        // wake up for the next tick while there are deadlines
+        n = epoll_wait(epfd, events, EPOLL_MAX_EVENTS, 
+                timers.count > 0 ? TIMER_TICK_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait failed");
+        }
+
+        for (i = 0; i < n; i++) {
+            struct conn *c = (struct conn *)events[i].data.ptr;
+            int res;
+
+            if (c->state == CONN_LISTEN) {
+                connAccept(epfd, c->sock, &timers);
+                continue;
+            }
+
+            if (c->state == CONN_READ) {
+                if (connRead(args->webRoot, c) < 0) {
+                    connClose(c);
+                    continue;
+                }
+                if (c->state == CONN_READ)
+                    continue;
+            }
+
+            res = connWrite(c);
+            if (res != 0) {
+                connClose(c);
+                continue;
+            }
+            // the client took what it could, give it SEND_TIMEOUT more
+            timerSet(&timers, &c->timer, DEADLINE_SEND, SEND_TIMEOUT);
+            if (events[i].events & EPOLLIN) {
+                // wait for the socket to become writable instead
+                ev.events = EPOLLOUT;
+                ev.data.ptr = c;
+                if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->sock, &ev) < 0)
+                    die("epoll_ctl failed");
+            }
+        }
+        timerAdvance(&timers, timerTicks(), connExpire);
+    }
+
+    return((void *)0);
+}
+
+/*
+ * io_uring mode.
+ *
+ * Same connection state machine as the event loop mode, but instead of
+ * waiting for readiness and then calling accept()/recv()/read()/send(),
+ * each worker queues those operations on its own io_uring and the
+ * kernel completes them asynchronously.  All operations prepared while
+ * handling one batch of completions are submitted with a single
+ * io_uring_enter() call.  We talk to the kernel directly through the
+ * raw system calls, so there is no dependency on liburing.
+ */
+
+#define URING_ENTRIES 256
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending; // SQEs prepared but not yet submitted
+    struct timerwheel timers; // deadlines of this ring's connections
+    struct __kernel_timespec tick; // TIMER_TICK_MS, for IORING_OP_TIMEOUT
+    int tickArmed;    // a tick timeout is queued
 };
 
 /*
- * Create a function to handle requests
- * As there are more than one argument, arg should be an struct
+ * Returns 1 if the kernel lets us create an io_uring instance.
  */
-void * thr_worker(void *arg)
+static int uringSupported(void)
 {
-    pthread_detach(pthread_self());
-    char line[1000];
-    char requestLine[1000];
-    int statusCode;
-    int clntSock; 
-    struct args *args;
-    struct sockaddr_in clntAddr;
-    const char *webRoot;
-    struct queue *q ; 
-    args = (struct args *)arg; 
-    char *tmp = &(requestLine[0]);
-    char* ntoabuf;
-    ntoabuf = malloc(sizeof(char) * 100);
-    // servSock = args->servSock;
-    webRoot = args->webRoot;
-    q = args->q;
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, 1, &p);
+    if (fd < 0)
+        return 0;
+    close(fd);
+    return 1;
+}
 
-    for(;;){
+/*
+ * Set up the ring and map the shared queues.
+ * Returns -1 if the kernel does not support io_uring.
+ */
+static int uringInit(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    void *sq_ptr, *cq_ptr;
 
-        // There is a while loop in this function, it will wait until there is a socket comming 
-        clntSock = queue_get(q); 
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
 
-        if (clntSock < 0)
-            die("queue_get failed"); 
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + 
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size)
+            sq_size = cq_size;
+        cq_size = sq_size;
+    }
 
-        // We should get client address from client socket
-        unsigned int clntLen = sizeof(clntAddr); 
-        if(getsockname(clntSock, (struct sockaddr *)&clntAddr, &clntLen) != 0)
-            die("getsockname failed");
+    sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE, 
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        die("mmap error");
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    }
+    else {
+        cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE, 
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            die("mmap error");
+    }
 
+    ring->sq_head = (unsigned *)((char *)sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)sq_ptr + p.sq_off.ring_mask);
+    ring->sq_entries = (unsigned *)((char *)sq_ptr + p.sq_off.ring_entries);
+    ring->sq_array = (unsigned *)((char *)sq_ptr + p.sq_off.array);
+
+    ring->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), 
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+            ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        die("mmap error");
+
+    ring->cq_head = (unsigned *)((char *)cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)cq_ptr + p.cq_off.cqes);
+
+    ring->pending = 0;
+    timerWheelInit(&ring->timers);
+    ring->tick.tv_sec = 0;
+    ring->tick.tv_nsec = TIMER_TICK_MS * 1000000L;
+    ring->tickArmed = 0;
+    return 0;
+}
 
-        // This is the first command after accept in original main
-        FILE *clntFp = fdopen(clntSock, "r");
-            if (clntFp == NULL)
-                die("fdopen failed");
+/*
+ * Submit all prepared SQEs and wait for at least waitFor completions.
+ */
+static void uringEnter(struct uring *ring, unsigned waitFor)
+{
+    unsigned flags = waitFor ? IORING_ENTER_GETEVENTS : 0;
+
+    for (;;) {
+        int res = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 
+                waitFor, flags, NULL, 0);
+        if (res >= 0) {
+            ring->pending -= res;
+            return;
+        }
+        if (errno != EINTR)
+            die("io_uring_enter failed");
+    }
+}
 
-        /*
-         * Let's parse the request line.
-         */
+/*
+ * Get the next free submission queue entry, zeroed out.
+ * If the queue is full, submit what we have first.
+ */
+static struct io_uring_sqe *uringGetSqe(struct uring *ring)
+{
+    unsigned tail = *ring->sq_tail;
+
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= 
+            *ring->sq_entries)
+        uringEnter(ring, 0);
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
 
-        char *method      = "";
-        char *requestURI  = "";
-        char *httpVersion = "";
+static struct io_uring_sqe *uringPrep(struct uring *ring, int opcode, 
+        int fd, void *addr, unsigned len, off_t off, struct conn *c)
+{
+    struct io_uring_sqe *sqe = uringGetSqe(ring);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (unsigned long)c;
+    return sqe;
+}
 
-        if (fgets(requestLine, sizeof(requestLine), clntFp) == NULL) {
-            // socket closed - there isn't much we can do
-            statusCode = 400; // "Bad Request"
-            goto loop_end;
-        }
+/*
+ * Arm an accept on a listening socket.  With multishot accept one SQE
+ * keeps producing a completion per new connection.
+ */
+static void uringPrepAccept(struct uring *ring, struct conn *l)
+{
+    struct io_uring_sqe *sqe = 
+        uringPrep(ring, IORING_OP_ACCEPT, l->sock, NULL, 0, 0, l);
+    if (l->multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
 
-        char *token_separators = "\t \r\n"; // tab, space, new line
-        method = strtok_r(requestLine, token_separators, &tmp);
-        requestURI = strtok_r(NULL, token_separators, &tmp);
-        httpVersion = strtok_r(NULL, token_separators, &tmp);
-        char *extraThingsOnRequestLine = strtok_r(NULL, token_separators, &tmp);
+/*
+ * Queue a timeout that completes after a tick, with no connection in
+ * user_data, so that the worker wakes up to expire deadlines.
+ */
+static void uringPrepTick(struct uring *ring)
+{
+    uringPrep(ring, IORING_OP_TIMEOUT, -1, &ring->tick, 1, 0, NULL);
+    ring->tickArmed = 1;
+}
 
-        // check if we have 3 (and only 3) things in the request line
-        if (!method || !requestURI || !httpVersion || 
-                extraThingsOnRequestLine) {
-            statusCode = 501; // "Not Implemented"
-            sendStatusLine(clntSock, statusCode);
-            goto loop_end;
-        }
+/*
+ * A connection missed its deadline.  An operation of ours may still be
+ * in flight on it, so we can't close it here; shutting the socket down
+ * makes that operation fail, and the connection is closed when it
+ * completes.
+ */
+static void uringExpire(struct timer *t)
+{
+    struct conn *c = (struct conn *)t->data;
 
-        // we only support GET method 
-        if (strcmp(method, "GET") != 0) {
-            statusCode = 501; // "Not Implemented"
-            sendStatusLine(clntSock, statusCode);
-            goto loop_end;
-        }
+    deadlineMissed(t->kind);
+    if (t->kind == DEADLINE_HEADER)
+        c->statusCode = 408; // "Request Timeout"
+    shutdown(c->sock, SHUT_RDWR);
+}
 
-        // we only support HTTP/1.0 and HTTP/1.1
-        if (strcmp(httpVersion, "HTTP/1.0") != 0 && 
-            strcmp(httpVersion, "HTTP/1.1") != 0) {
-            statusCode = 501; // "Not Implemented"
-            sendStatusLine(clntSock, statusCode);
-            goto loop_end;
+/*
+ * Queue the next operation for the connection, or close it.
+ */
+static void uringNext(struct uring *ring, struct conn *c)
+{
+    switch (c->state) {
+    case CONN_READ:
+        uringPrep(ring, IORING_OP_RECV, c->sock, c->req + c->reqLen, 
+                sizeof(c->req) - c->reqLen, 0, c);
+        break;
+    case CONN_SEND_HEADER:
+    case CONN_SEND_BODY:
+        if (c->outSent < c->outLen) {
+            struct io_uring_sqe *sqe = uringPrep(ring, IORING_OP_SEND, 
+                    c->sock, c->out + c->outSent, c->outLen - c->outSent, 
+                    0, c);
+            // hold back the status line of a 200 until the body follows
+            if (c->state == CONN_SEND_HEADER && c->fileFd >= 0)
+                sqe->msg_flags = MSG_MORE;
         }
-        
-        // requestURI must begin with "/"
-        if (!requestURI || *requestURI != '/') {
-            statusCode = 400; // "Bad Request"
-            sendStatusLine(clntSock, statusCode);
-            goto loop_end;
+        else if (c->fileFd >= 0) {
+            c->state = CONN_SEND_BODY;
+            uringPrep(ring, IORING_OP_READ, c->fileFd, c->out, 
+                    sizeof(c->out), c->fileOff, c);
         }
-
-        // make sure that the requestURI does not contain "/../" and 
-        // does not end with "/..", which would be a big security hole!
-        int len = strlen(requestURI);
-        if (len >= 3) {
-            char *tail = requestURI + (len - 3);
-            if (strcmp(tail, "/..") == 0 || 
-                    strstr(requestURI, "/../") != NULL)
-            {
-                statusCode = 400; // "Bad Request"
-                sendStatusLine(clntSock, statusCode);
-                goto loop_end;
-            }
+        else {
+            connClose(c);
         }
+        break;
+    default:
+        break;
+    }
+}
 
-        /*
-         * Now let's skip all headers.
-         */
+/*
+ * Handle one completion for connection c.
+ */
+static void uringComplete(struct uring *ring, const char *webRoot, 
+        struct conn *c, struct io_uring_cqe *cqe)
+{
+    int res = cqe->res;
+
+    if (c->state == CONN_LISTEN) {
+        if (res == -EINVAL && c->multishot) {
+            // kernel too old for multishot accept, do one at a time
+            c->multishot = 0;
+            uringPrepAccept(ring, c);
+            return;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            uringPrepAccept(ring, c);
+        if (res < 0) {
+            if (res != -EINTR && res != -ECONNABORTED)
+                fprintf(stderr, "accept failed: %s\n", strerror(-res));
+            return;
+        }
 
+        struct conn *nc = connNew(res);
+        unsigned int clntLen = sizeof(nc->clntAddr);
+        memset(&nc->clntAddr, 0, sizeof(nc->clntAddr));
+        getpeername(res, (struct sockaddr *)&nc->clntAddr, &clntLen);
+        timerSet(&ring->timers, &nc->timer, DEADLINE_HEADER, 
+                HEADER_TIMEOUT);
+        uringNext(ring, nc);
+        return;
+    }
 
-        while (1) {
-            if (fgets(line, sizeof(line), clntFp) == NULL) {
-                // socket closed prematurely - there isn't much we can do
-                statusCode = 400; // "Bad Request"
-                goto loop_end;
-            }
-            if (strcmp("\r\n", line) == 0 || strcmp("\n", line) == 0) {
-                // This marks the end of headers.  
-                // Break out of the while loop.
-                break;
+    switch (c->state) {
+    case CONN_READ:
+        if (res <= 0) {
+            // socket closed prematurely - there isn't much we can do
+            if (c->statusCode == 0) // or we did, on a timeout
+                c->statusCode = 400; // "Bad Request"
+            connClose(c);
+            return;
+        }
+        c->reqLen += res;
+
+        int status = httpParse(&c->parsed, c->req, c->reqLen);
+        if (status != PARSE_INCOMPLETE)
+            connStartResponse(webRoot, c, status);
+        else if (c->reqLen == sizeof(c->req)) {
+            // headers too large for us
+            connStartResponse(webRoot, c, 431);
+        }
+        if (c->state != CONN_READ)
+            timerSet(&ring->timers, &c->timer, DEADLINE_SEND, 
+                    SEND_TIMEOUT);
+        break;
+    case CONN_SEND_HEADER:
+    case CONN_SEND_BODY:
+        if (res < 0) {
+            fprintf(stderr, "%s failed: %s\n", 
+                    c->outSent < c->outLen ? "send()" : "read", 
+                    strerror(-res));
+            connClose(c);
+            return;
+        }
+        if (c->outSent < c->outLen) {
+            c->outSent += res;
+            timerSet(&ring->timers, &c->timer, DEADLINE_SEND, 
+                    SEND_TIMEOUT);
+        }
+        else {
+            // a file read completed
+            if (res == 0) {
+                if (c->fileOff < c->fileLen)
+                    fprintf(stderr, "read ended early: file shrank\n");
+                connClose(c);
+                return;
             }
+            c->fileOff += res;
+            c->outLen = res;
+            c->outSent = 0;
         }
+        break;
+    default:
+        break;
+    }
+    uringNext(ring, c);
+}
 
-        /*
-         * At this point, we have a well-formed HTTP GET request.
-         * Let's handle it.
-         */
-
-        statusCode = handleFileRequest(webRoot, requestURI, clntSock);
-
-loop_end:
-
-        /*
-         * Done with client request.
-         * Log it, close the client socket, and go back to accepting
-         * connection.
-         */
-        
-        fprintf(stderr, "%s \"%s %s %s\" %d %s\n",
-                inet_ntop(AF_INET, &clntAddr.sin_addr, ntoabuf, 100),
-                method,
-                requestURI,
-                httpVersion,
-                statusCode,
-                getReasonPhrase(statusCode));
+void * uring_worker(void *arg)
+{
+    struct epoll_args *args = (struct epoll_args *)arg;
+    struct uring ring;
+    int i;
+
+    if (uringInit(&ring, URING_ENTRIES) < 0)
+        die("io_uring_setup failed");
+
+    for (i = 0; i < args->nServSocks; i++) {
+        struct conn *l = (struct conn *)malloc(sizeof(*l));
+        if (l == NULL)
+            die("malloc failed");
+        l->state = CONN_LISTEN;
+        l->sock = args->servSocks[i];
+        l->multishot = 1; // try multishot accept first
+        uringPrepAccept(&ring, l);
+    }
 
-        // close the client socket 
-        fclose(clntFp);
-    } // for(;;)
+    for (;;) {
+        // wake up for the next tick while there are deadlines
+        if (ring.timers.count > 0 && !ring.tickArmed)
+            uringPrepTick(&ring);
+
+        // submit everything queued by the last batch and wait
+        uringEnter(&ring, 1);
+
+        unsigned head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            if (cqe.user_data == 0) {
+                ring.tickArmed = 0;
+                continue;
+            }
+            uringComplete(&ring, args->webRoot, 
+                    (struct conn *)(unsigned long)cqe.user_data, &cqe);
+        }
+        timerAdvance(&ring.timers, timerTicks(), uringExpire);
+    }
 
-    free(args);
     return((void *)0);
-
 }
 
 int main(int argc, char *argv[])
 {
     
     int i = 0; 
-    struct args *args; 
     int err;
     int nfds = 3;
     fd_set readfds;
@@ -499,57 +3357,161 @@ int main(int argc, char *argv[])
     // fd_set *restrict writefds; //not interested?
     // fd_set *restrict exceptfds;
     const char *webRoot;
-    struct queue *sock_queue; 
-    sock_queue = (struct queue *)malloc(sizeof(*sock_queue)); 
-    queue_init(sock_queue); 
+    struct scheduler *sched; 
 
     // Ignore SIGPIPE so that we don't terminate when we call
     // send() on a disconnected socket.
     if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
         die("signal() failed");
-    if (argc < 3) {
+    int mode = MODE_THREADS;
+    const char *logFile = NULL; // -l: access log file instead of stderr
+    int minThreads = MIN_THREADS; // -m
+    int maxThreads = MAX_THREADS; // -n
+    int backlog = MAXPENDING;     // -b
+    long maxQueued = MAX_QUEUED;  // -q
+    long waitTarget = QUEUE_WAIT_TARGET_MS; // -w, 0 turns it off
+    int opt;
+    while ((opt = getopt(argc, argv, "eul:m:n:b:q:w:")) != -1) {
+        switch (opt) {
+        case 'b':
+            backlog = atoi(optarg);
+            if (backlog < 1)
+                argc = 0; // print usage below
+            break;
+        case 'q':
+            maxQueued = atol(optarg);
+            if (maxQueued < 1)
+                argc = 0; // print usage below
+            break;
+        case 'w':
+            waitTarget = atol(optarg);
+            if (waitTarget < 0)
+                argc = 0; // print usage below
+            break;
+        case 'm':
+            minThreads = atoi(optarg);
+            break;
+        case 'n':
+            maxThreads = atoi(optarg);
+            break;
+        case 'l':
+            logFile = optarg;
+            break;
+        case 'e':
+            mode = MODE_EPOLL;
+            break;
+        case 'u':
+            mode = MODE_URING;
+            break;
+        default:
+            argc = 0; // print usage below
+        }
+    }
+    if (minThreads < 1 || maxThreads < minThreads || 
+            maxThreads > MAX_THREADS)
+        argc = 0; // print usage below
+    if (argc - optind < 2) {
         fprintf(stderr,
-            "usage: %s <server_port> [<server_port> ...] <web_root>\n",
+            "usage: %s [-e | -u] [-l log_file] "
+            "[-m min_threads] [-n max_threads] [-b backlog] "
+            "[-q max_queued] [-w wait_target_ms] "
+            "<server_port> [<server_port> ...] <web_root>\n",
             argv[0]);
         exit(1);
     
     }
     nfds = argc + 1;
     int servSocks[32];
+    int nServSocks = 0;
     memset(servSocks, -1, sizeof(servSocks));
     FD_ZERO(&readfds);
     // Create server sockets for all ports we listen on
-    for (i = 1; i < argc - 1; i++) {
-        if (i >= (sizeof(servSocks) / sizeof(servSocks[0])))
+    for (i = optind; i < argc - 1; i++) {
+        if (nServSocks >= (sizeof(servSocks) / sizeof(servSocks[0])))
             die("Too many listening sockets");
-        servSocks[i - 1] = createServerSocket(atoi(argv[i]));
-        FD_SET(servSocks[i-1], &readfds);
-        if(servSocks[i-1] + 1 > nfds){
-            nfds = servSocks[i-1]+1;
+        servSocks[nServSocks] = createServerSocket(atoi(argv[i]), backlog);
+        FD_SET(servSocks[nServSocks], &readfds);
+        if(servSocks[nServSocks] + 1 > nfds){
+            nfds = servSocks[nServSocks]+1;
         }
+        nServSocks++;
         // fprintf(stderr, "servsocks: %d : %d \n", servSocks[i-1], atoi(argv[i]));
     }
     // fprintf(stderr, "maxfds: %d \n", nfds);
     webRoot = argv[argc - 1];
+
+    clockStart();
+    logInit(logFile);
+    responseInit();
+    scanInit();
+    logStart();
     prev_readfds = readfds;
     // unsigned short servPort = atoi(argv[1]);
     // const char *webRoot = argv[2];
  
     // int servSock = createServerSocket(servPort);
 
-    struct sockaddr_in clntAddr;
+    if (mode == MODE_URING) {
+        // Fall back to the thread pool if the kernel lacks io_uring.
+        if (!uringSupported()) {
+            perror("io_uring_setup failed, using the thread pool");
+            mode = MODE_THREADS;
+        }
+    }
 
-    args = (struct args *)malloc(sizeof(*args));
-    args->webRoot = webRoot; 
-    args->q = sock_queue; 
+    if (mode != MODE_THREADS) {
+        struct epoll_args eargs;
+        eargs.webRoot = webRoot;
+        eargs.servSocks = servSocks;
+        eargs.nServSocks = nServSocks;
+        if (mode == MODE_EPOLL) {
+            for (i = 0; i < nServSocks; i++)
+                setNonBlocking(servSocks[i]);
+        }
+
+        // SIGUSR1 prints the timeout counts.  The workers inherit it
+        // blocked, so it is only taken by sigwait() below.
+        sigset_t usr1;
+        sigemptyset(&usr1);
+        sigaddset(&usr1, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+        for (i = 0; i < N_THREADS; i++) {
+            err = pthread_create(&thread_pool[i], NULL, 
+                    mode == MODE_EPOLL ? epoll_worker : uring_worker, &eargs);
+            if (err != 0)
+                die("can’t create thread");
+        }
+        for (;;) {
+            int sig;
+            if (sigwait(&usr1, &sig) == 0)
+                printTimeoutStats();
+        }
+    }
 
-    // create thread
-    for (i=0; i<N_THREADS; i++) {
-        err = pthread_create(&thread_pool[i], NULL, thr_worker, args);
-        if (err != 0)
-            die("can’t create thread");
+    struct sockaddr_in clntAddr;
 
-    } // for (; i<N_THREADS; i++)
+    // SIGUSR1 prints the per-worker queue depths
+    struct sigaction act;
+    act.sa_handler = sig_usr1;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    if (sigaction(SIGUSR1, &act, NULL) < 0)
+        die("signal error");
+
+    poolTimersStart();
+
+    // create threads, N_THREADS of them unless -m or -n say otherwise
+    sched = (struct scheduler *)malloc(sizeof(*sched)); 
+    sched_init(sched, minThreads, maxThreads, maxQueued, 
+            waitTarget * 1000UL);  
+    for (i = 0; i < N_THREADS || i < minThreads; i++) {
+        if (!startWorker(sched, webRoot)) {
+            if (i < minThreads)
+                die("can’t create thread");
+            break;
+        }
+    }
 
     for (;;){
 
@@ -563,30 +3525,38 @@ int main(int argc, char *argv[])
         unsigned int clntLen = sizeof(clntAddr); 
         int servs = 0;
         while(servs == 0){
+            // select() overwrites readfds, start from the full set
+            readfds = prev_readfds;
             servs = select(nfds, &readfds, NULL, NULL, NULL);
             if(servs < 0){
-                if(errno == EINTR){
+                if(errno != EINTR){
                     die("select failed");
                 }
-                else{
-                    servs = 0;
-                }
+                servs = 0;
+            }
+            if (key == 1) {
+                printWorkerStats(sched);
+                key = 0;
             }
-            readfds = prev_readfds;
         }
-        for(int validfd = 1; validfd <= nfds; validfd ++){
+        for(int validfd = 1; validfd < nfds; validfd ++){
             if (FD_ISSET(validfd, &readfds)){
                 int clntSock = accept(validfd, (struct sockaddr *)&clntAddr, &clntLen);
                 if (clntSock < 0)
                     die("accept() failed");
-                queue_put(sock_queue, clntSock); 
+                if (!sched_admit(sched)) {
+                    // overloaded: answer now, and add a worker if we may
+                    shedConnection(clntSock);
+                    startWorker(sched, webRoot);
+                }
+                else if (sched_put(sched, clntSock))
+                    startWorker(sched, webRoot); 
                 // break;
             }
         }
-        // readfds = prev_readfds;
     } // for (;;)
-    queue_destroy(sock_queue);
-    free(sock_queue);
+    sched_destroy(sched);
+    free(sched);
     // if (signal(SIGINT, sig_int) == SIG_ERR)
     //     die("signal(SIGINT) error");
     return 0;